@@ -0,0 +1,88 @@
+/*
+Sample of the C++20 coroutine interface of the library (Coroutine.h), built as C++20 on its own so the interface is compiled and run
+with the solution while the program itself stays C++17.
+
+It sets up a HistogramEqualizer as Assignment does, equalizes the image once with Equalize and then awaits EqualizeCoroutine on a few
+copies of it at once, resumed by a scheduler thread. On a device the copies outnumber the equalizer's two slots, so the coroutines also
+wait for slots through the event callbacks. Every result has to match Equalize's, the exit code is 1 when one does not.
+
+Usage: "Coroutine Sample" [image] [engine: cl, cpu or auto] [platform] [device]
+*/
+
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "Utils.h"
+#include "CImg.h"
+#include "HistogramEqualizer.h"
+#include "Coroutine.h"
+
+#ifndef __cpp_impl_coroutine
+#error The coroutine sample has to be built as C++20 (LanguageStandard stdcpp20)
+#endif
+
+using namespace std;
+using namespace cimg_library;
+using namespace histeq;
+
+//Awaits EqualizeCoroutine on count copies of image at once, resumed on a scheduler thread, and returns their results
+vector<CImg<unsigned char>> EqualizeWithCoroutines(HistogramEqualizer& equalizer, const CImg<unsigned char>& image, int count) {
+	CoroutineScheduler scheduler;
+	thread resumer([&] { scheduler.Run(); });
+
+	vector<CImg<unsigned char>> outputs(count, CImg<unsigned char>(image.width(), image.height(), image.depth(), equalizer.OutputChannels(image.spectrum())));
+	vector<promise<void>> finished(count);
+	auto equalize = [&](int i) -> Task<void> {
+		co_await EqualizeCoroutine(equalizer, scheduler, image.data(), outputs[i].data(), image.width(), image.height(), image.depth(), image.spectrum());
+		finished[i].set_value();
+	};
+	for (int i = 0; i < count; i++) {
+		Spawn(equalize(i), [&finished, i](exception_ptr error) { finished[i].set_exception(error); });
+	}
+
+	//The frames are freed on the resumer before it returns, so they go before the images they point at
+	vector<future<void>> done;
+	for (promise<void>& result : finished) { done.push_back(result.get_future()); }
+	for (future<void>& result : done) { result.wait(); }
+	scheduler.Stop();
+	resumer.join();
+	for (future<void>& result : done) { result.get(); } //rethrows what a coroutine threw
+
+	return outputs;
+}
+
+int main(int argc, char** argv) {
+	string image_filename = argc > 1 ? argv[1] : "../Tutorial 2/test.pgm";
+	EqualizerSettings settings;
+	settings.engine = argc > 2 ? argv[2] : "cl";
+	settings.platform_id = argc > 3 ? atoi(argv[3]) : 0;
+	settings.device_id = argc > 4 ? atoi(argv[4]) : 0;
+	settings.kernel_file = "../Tutorial 2/kernels/my_kernels.cl";
+	const int copies = 4;
+
+	try {
+		HistogramEqualizer equalizer(settings);
+		if (!equalizer.FallbackReason().empty()) { std::cerr << "No OpenCL device available (" << equalizer.FallbackReason() << "), falling back to the CPU engine" << std::endl; }
+
+		CImg<unsigned char> image = LoadImage8(image_filename);
+		CImg<unsigned char> expected = equalizer.Equalize(image);
+		vector<CImg<unsigned char>> outputs = EqualizeWithCoroutines(equalizer, image, copies);
+
+		size_t mismatches = 0;
+		int max_difference = 0;
+		for (const CImg<unsigned char>& output : outputs) { mismatches += CompareImages(output, expected, max_difference); }
+		std::cout << copies << " coroutine(s) on " << (equalizer.PrefersDevice(image.size()) ? "the device" : "the CPU engine") << ": " << mismatches << " of "
+			<< copies * expected.size() << " pixel(s) differ from Equalize" << (mismatches ? ", by at most " + to_string(max_difference) : "") << std::endl;
+		return mismatches ? 1 : 0;
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << err._message << std::endl;
+	}
+
+	return 1;
+}
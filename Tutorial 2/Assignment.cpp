@@ -22,24 +22,80 @@ so less atomic functions are needed for the global version of the histogram. The
 Extra features which have been developed are:
 	1.	Variable bin size
 	2.	Padding to allow for any bin numbers
+	3.	Batch mode - many images processed with one context, one built program and one set of buffers
+	4.	A native multithreaded CPU engine, used when there is no OpenCL device and to verify the kernels
+	5.	Per-channel equalization of colour images, each channel with its own histogram and LUT
+	6.	Luma-only equalization of colour images, converting to YCbCr and back on the device so hues are kept
+	7.	Contrast limited adaptive histogram equalization (CLAHE), every tile of the image in the same three launches
+	8.	Histogram specification, matching images to the histogram of a reference image computed once per run
+	9.	Sliding window equalization of video frames, each frame mapped with the histogram of the last K frames
+	10.	Streaming raw or PNM frames from stdin to stdout through pinned memory, for camera pipelines
+	11.	Histograms of many regions of interest in a single launch, read from the full image without cropping
+	12.	Packed batches of small images, many images equalized in one histogram, one scan and one map launch
+	13.	Histogram back-projection of a model histogram from a template, in intensity or 2D hue-saturation, in one fused launch per frame
+	14.	Joint 2D histograms (R x G, hue x saturation or two images) and the mutual information of many candidate alignments at once
+	15.	Histogram statistics (percentiles, median, mean, variance, entropy and Otsu's threshold) from the device histograms in one launch
+	16.	Percentile-clipped linear contrast stretching, the clip points found on the device from the cumulative histogram
+	17.	Volumetric equalization of image stacks, globally, per slice in one launch or with 3D-tiled CLAHE, streamed through the device in slabs when too large
+	18.	Splitting one image across every OpenCL device of one or more platforms, in proportion to each device's measured throughput
+	19.	Device fission by NUMA node on multi-socket CPU runtimes, batch pipelines pinned to the nodes and single images split into row bands
+	20.	A daemon mode that sets the device up once and serves requests over a Unix domain socket, images passed as files or in shared memory
+	21.	The engine as a library class for embedding (HistogramEqualizer.h), set up once and reused by every call, which this program wraps
+	22.	A C++20 coroutine interface to the library (Coroutine.h, see the Coroutine Sample project), images awaited on OpenCL event callbacks instead of blocking a thread each
 
 Variables can be set/changed when running through the CMD.
 To change the bin size, use identifier -b followed by a space and the number of bins you would like.
 To change the file, use identifier -f followed by a space and the file name you would like.
 To change the scan, use identifier -s followed by a space and the characters for the scan.
+To equalize each colour channel separately, use identifier -m followed by a space and channel, or luma to only equalize brightness.
+For CLAHE, use identifier -m followed by clahe, the tile size is set with -g (e.g. 64x64) and the clip limit with -k.
+To match images to a reference histogram, use identifier -m followed by match and -r followed by the reference image.
+To stretch the contrast linearly instead of equalizing, use identifier -m followed by stretch, -L sets the low and high percentiles clipped (e.g. 1,99).
+To equalize a volume, use identifier -z followed by a volume file or a directory, pattern or list of slices, with -m global, slice or clahe (-g WxHxD for box tiles), -Z sets the slab size in MB.
+To back-project a model histogram, use identifier -m followed by backproject and -M followed by the template image (template@x,y,width,height for a region of it), add -H for hue-saturation.
+To treat a batch as the frames of a video, use identifier -w followed by the number of frames to smooth the histogram over.
+To stream frames from stdin to stdout, use identifier -S followed by pnm or the raw frame size as WxHxC (WxHxCx16 for 16 bit samples).
+To serve requests from other processes (POSIX only), use identifier -D followed by the socket path, files are written to the directory given by -O, see Daemon.h for the requests.
+To compute the histograms of regions of interest instead of equalizing, use identifier -R followed by a file listing the regions.
+To compute a joint histogram instead of equalizing, use identifier -J followed by rg, hs or a second image, -j sets the bins per axis (e.g. 64x32) and -t the shift radius searched when registering.
+To process many images, use identifier -B followed by a directory, a pattern or a text file listing the images, outputs are written to the directory given by -O.
+To equalize many small images together in batch mode, use identifier -P followed by the number of images per pack.
+To run without any windows, use identifier -o followed by the file to write the equalized image to, -x also writes the histograms and LUT.
+To write the statistics of every image's histograms, use identifier -a followed by a .csv file, -q sets the percentiles (e.g. 1,5,95,99).
+To split an image across every device of some platforms, use identifier -A followed by all or the platform ids (e.g. 0,1).
+To split the selected device into one sub-device per NUMA node, use identifier -N.
 You can also change the platform and device using the identifiers -p / -d respectively, along with the id of the platform/device.
 To finalize, the times taken for all the kernels to run are output to the console.
 
 */
 
 
+#include <chrono>
 #include <iostream>
 #include <vector>
 
 #include "Utils.h"
 #include "CImg.h"
-
+#include "Equalizer.h"
+#include "Batch.h"
+#include "CpuEngine.h"
+#include "CostModel.h"
+#include "Pipeline.h"
+#include "Reference.h"
+#include "BackProjection.h"
+#include "Video.h"
+#include "Stream.h"
+#include "Roi.h"
+#include "Joint.h"
+#include "Statistics.h"
+#include "Volume.h"
+#include "MultiDevice.h"
+#include "Daemon.h"
+#include "HistogramEqualizer.h"
+
+using namespace std;
 using namespace cimg_library;
+using namespace histeq;
 
 void print_help() {
 	std::cerr << "Application usage:" << std::endl;
@@ -47,9 +103,39 @@ void print_help() {
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -A : split the image across every device of these platforms, all or comma separated platform ids, shares follow each device's measured throughput (global mode, single images)" << std::endl;
+	std::cerr << "  -N : split the device into one sub-device per NUMA node, batch images go to the nodes in turn and single images (global mode) are split into a row band per node" << std::endl;
 	std::cerr << "  -f : input image file (default: test.pgm)" << std::endl;
 	std::cerr << "  -b : bin size (default: 128)" << std::endl;
 	std::cerr << "  -s : scan (default: Blelloch - Goes to Hillis-Steele if bin size if not a power of 2)(options: bl-Blelloch/hs-Hillis-Steele/si-Simple)" << std::endl;
+	std::cerr << "  -m : mode (default: global)(options: global-one histogram over every channel/channel-one histogram per colour channel, scanned in local memory/luma-equalizes Y of YCbCr only, keeping the colours/clahe-contrast limited adaptive, per tile/match-matches the histogram of the -r image/backproject-likelihood of every pixel in the -M model histogram/stretch-linear stretch between the -L percentiles/slice-one histogram per slice of a volume, every slice in one launch)" << std::endl;
+	std::cerr << "  -g : tile size in pixels for clahe, WxH or one number for square tiles, WxHxD for box tiles of D slices in a volume (default: 64x64, volumes 64x64x64)" << std::endl;
+	std::cerr << "  -r : reference image for match mode, its histogram is computed once and reused for every image" << std::endl;
+	std::cerr << "  -M : template image for backproject mode, file or file@x,y,width,height for a region, its histogram is computed once and reused for every image" << std::endl;
+	std::cerr << "  -H : backproject over a 2D hue-saturation histogram of bin size x bin size bins instead of intensity (luma for colour images)" << std::endl;
+	std::cerr << "  -L : low and high percentiles the stretch mode clips to 0 and 255, comma separated (default: 1,99)" << std::endl;
+	std::cerr << "  -k : clip limit for clahe, as a multiple of the average bin count (default: 2)" << std::endl;
+	std::cerr << "  -o : headless, write the equalized image to this file instead of displaying it and exit" << std::endl;
+	std::cerr << "  -x : write the histogram, cumulative histogram and LUT to this file (.csv as text, otherwise binary)" << std::endl;
+	std::cerr << "  -a : write the statistics of every histogram (count, mean, variance, entropy, median, Otsu threshold and percentiles) to this .csv file" << std::endl;
+	std::cerr << "  -q : percentiles for -a, comma separated, at most 8 (default: 1,5,25,75,95,99)" << std::endl;
+	std::cerr << "  -J : joint histogram instead of equalizing, rg-red x green/hs-hue x saturation/any other value is a second image whose first channel is paired with the image's, writes it to the -x file" << std::endl;
+	std::cerr << "  -j : joint histogram bins per axis, AxB or a single number for both (default: the bin size)" << std::endl;
+	std::cerr << "  -t : registration, every shift of the second image within this many pixels is scored by mutual information (default: 0)" << std::endl;
+	std::cerr << "  -z : volume input instead of -f, a volume file (e.g. .cimg, .inr, .nii) or a directory, pattern or text file listing 2D slices stacked in order (global, slice and clahe modes)" << std::endl;
+	std::cerr << "  -Z : slab size in MB, volumes larger than this are streamed through the device a slab at a time (default: from the device memory)" << std::endl;
+	std::cerr << "  -R : region file, one \"x y width height\" per line, writes each region's histogram to the -x file (or prints them) instead of equalizing" << std::endl;
+	std::cerr << "  -e : engine (default: cl)(options: cl-OpenCL/cpu-native multithreaded C++/auto-picks per image from a measured cost model), falls back to cpu when there is no OpenCL device" << std::endl;
+	std::cerr << "  -c : cost model cache file for -e auto (default: engine_costs.txt)" << std::endl;
+	std::cerr << "  -V : verify the OpenCL output against the CPU engine" << std::endl;
+	std::cerr << "  -B : batch input, a directory, a pattern (e.g. images/*.pgm) or a text file listing one image per line (can be repeated)" << std::endl;
+	std::cerr << "  -O : output directory for batch and daemon modes (default: output)" << std::endl;
+	std::cerr << "  -w : sliding window, the batch is a video and each frame uses the histogram of the last K frames (global mode only)" << std::endl;
+	std::cerr << "  -S : stream frames from stdin to stdout, pnm for concatenated PNM frames or WxHxC[x16] for raw interleaved frames" << std::endl;
+	std::cerr << "  -D : daemon (POSIX only), set up once and serve equalize requests on this Unix domain socket until a quit request (files under -O or POSIX shared memory, see Daemon.h)" << std::endl;
+	std::cerr << "  -P : pack up to N small images (256KB or less) into one set of launches in batch mode (global mode only, default: off)" << std::endl;
+	std::cerr << "  -T : number of decode and of encode threads in batch mode (default: half the hardware threads)" << std::endl;
+	std::cerr << "  -v : verbose, report every image processed in batch mode and the engine chosen for it" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
@@ -57,174 +143,432 @@ int main(int argc, char** argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
+	string multi_spec;
+	bool numa = false;
 	string image_filename = "test.pgm";
 	int bin_size = 32;
 
 	string scanName = "hs";
+	string mode = "global";
+	int tile_width = 64;
+	int tile_height = 64;
+	int tile_depth = 0;
+	float clip_limit = 2.0f;
+	string reference_filename;
+	string model_spec;
+	bool hue_saturation = false;
+	int window = 0;
+	string stream_spec;
+	string daemon_socket;
+	string roi_filename;
+	string volume_spec;
+	int slab_mb = 0;
+	string joint_source;
+	string joint_bins;
+	int shift_radius = 0;
+
+	string output_filename;
+	string sidecar_filename;
+	string statistics_filename;
+	string percentile_spec;
+	string stretch_spec;
+
+	vector<string> batch_inputs;
+	string output_dir = "output";
+	bool verbose = false;
+	int threads = max(1, (int)std::thread::hardware_concurrency() / 2);
+	int pack_images = 0;
+
+	string engine = "cl";
+	string cost_cache = "engine_costs.txt";
+	bool verify = false;
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-A") == 0) && (i < (argc - 1))) { multi_spec = argv[++i]; }
+		else if (strcmp(argv[i], "-N") == 0) { numa = true; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
 		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { scanName = argv[++i]; }
 		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bin_size = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { mode = argv[++i]; }
+		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) {
+			if (sscanf(argv[++i], "%dx%dx%d", &tile_width, &tile_height, &tile_depth) == 1) { tile_height = tile_width; }
+		}
+		else if ((strcmp(argv[i], "-L") == 0) && (i < (argc - 1))) { stretch_spec = argv[++i]; }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { clip_limit = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reference_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-M") == 0) && (i < (argc - 1))) { model_spec = argv[++i]; }
+		else if (strcmp(argv[i], "-H") == 0) { hue_saturation = true; }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { window = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-S") == 0) && (i < (argc - 1))) { stream_spec = argv[++i]; }
+		else if ((strcmp(argv[i], "-D") == 0) && (i < (argc - 1))) { daemon_socket = argv[++i]; }
+		else if ((strcmp(argv[i], "-z") == 0) && (i < (argc - 1))) { volume_spec = argv[++i]; }
+		else if ((strcmp(argv[i], "-Z") == 0) && (i < (argc - 1))) { slab_mb = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-R") == 0) && (i < (argc - 1))) { roi_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-J") == 0) && (i < (argc - 1))) { joint_source = argv[++i]; }
+		else if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1))) { joint_bins = argv[++i]; }
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { shift_radius = max(0, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { sidecar_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { statistics_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-q") == 0) && (i < (argc - 1))) { percentile_spec = argv[++i]; }
+		else if ((strcmp(argv[i], "-B") == 0) && (i < (argc - 1))) { batch_inputs.push_back(argv[++i]); }
+		else if ((strcmp(argv[i], "-O") == 0) && (i < (argc - 1))) { output_dir = argv[++i]; }
+		else if ((strcmp(argv[i], "-P") == 0) && (i < (argc - 1))) { pack_images = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-T") == 0) && (i < (argc - 1))) { threads = max(1, atoi(argv[++i])); }
+		else if (strcmp(argv[i], "-v") == 0) { verbose = true; }
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { engine = argv[++i]; }
+		else if (strcmp(argv[i], "-V") == 0) { verify = true; }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { cost_cache = argv[++i]; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
+	if (mode != "global" && mode != "channel" && mode != "luma" && mode != "clahe" && mode != "match" && mode != "backproject" && mode != "stretch" && mode != "slice") {
+		std::cerr << "ERROR: unknown mode " << mode << std::endl;
+		print_help();
+		return 1;
+	}
+	if (mode == "match" && reference_filename.empty()) {
+		std::cerr << "ERROR: match mode needs a reference image (-r)" << std::endl;
+		return 1;
+	}
+	if (mode == "backproject" && model_spec.empty()) {
+		std::cerr << "ERROR: backproject mode needs a template image (-M)" << std::endl;
+		return 1;
+	}
+	if (window > 0 && mode != "global") {
+		std::cerr << "ERROR: the sliding window only works in global mode" << std::endl;
+		return 1;
+	}
+	if (pack_images > 1 && mode != "global") {
+		std::cerr << "ERROR: packing only works in global mode" << std::endl;
+		return 1;
+	}
+	if (!multi_spec.empty() && (mode != "global" || !batch_inputs.empty() || !stream_spec.empty() || !volume_spec.empty())) {
+		std::cerr << "ERROR: splitting across devices only works for single images in global mode" << std::endl;
+		return 1;
+	}
+#ifdef _WIN32
+	if (!daemon_socket.empty()) {
+		std::cerr << "ERROR: the daemon (-D) is POSIX only, it needs Unix domain sockets and POSIX shared memory" << std::endl;
+		return 1;
+	}
+#endif
+	if (!daemon_socket.empty() && (!batch_inputs.empty() || !stream_spec.empty() || !volume_spec.empty() || !multi_spec.empty() || window > 0)) {
+		std::cerr << "ERROR: the daemon serves single images, it cannot be combined with -B, -S, -z, -A or -w" << std::endl;
+		return 1;
+	}
+	if (numa && !multi_spec.empty()) {
+		std::cerr << "ERROR: -N splits the -p/-d device, it cannot be combined with -A" << std::endl;
+		return 1;
+	}
+	if (tile_width < 1 || tile_height < 1 || tile_depth < 0) {
+		std::cerr << "ERROR: invalid tile size " << tile_width << "x" << tile_height << (tile_depth ? "x" + to_string(tile_depth) : "") << std::endl;
+		return 1;
+	}
+	if (!volume_spec.empty()) {
+		if (mode != "global" && mode != "slice" && mode != "clahe") {
+			std::cerr << "ERROR: volumes are equalized in the global, slice or clahe modes" << std::endl;
+			return 1;
+		}
+		//Volumes get box tiles unless a depth was given
+		if (tile_depth == 0) { tile_depth = tile_height; }
+		image_filename = volume_spec;
+	}
+
+	if (!statistics_filename.empty() && (mode == "clahe" || mode == "backproject" || window > 0 || !stream_spec.empty())) {
+		std::cerr << "ERROR: statistics are only computed for single images and batches in the global, channel, slice, luma, match and stretch modes" << std::endl;
+		return 1;
+	}
+	vector<int> percentiles = EqualizeOptions().percentiles;
+	if (!percentile_spec.empty() && !ParsePercentiles(percentile_spec, percentiles)) {
+		std::cerr << "ERROR: invalid percentiles " << percentile_spec << ", give 1 to 8 values from 0 to 100" << std::endl;
+		return 1;
+	}
+
+	vector<int> stretch = { EqualizeOptions().stretch_low, EqualizeOptions().stretch_high };
+	if (!stretch_spec.empty() && (!ParsePercentiles(stretch_spec, stretch) || stretch.size() != 2 || stretch[0] >= stretch[1])) {
+		std::cerr << "ERROR: invalid stretch percentiles " << stretch_spec << ", give a low and a higher high value from 0 to 100" << std::endl;
+		return 1;
+	}
+
+	int binsA = bin_size;
+	int binsB = bin_size;
+	if (!joint_bins.empty() && !ParseJointBins(joint_bins, binsA, binsB)) {
+		std::cerr << "ERROR: invalid joint bins " << joint_bins << std::endl;
+		return 1;
+	}
+
+	StreamFormat stream_format;
+	if (!stream_spec.empty()) {
+		if (!ParseStreamFormat(stream_spec, stream_format)) {
+			std::cerr << "ERROR: invalid stream format " << stream_spec << std::endl;
+			return 1;
+		}
+		//The frames go to stdout, so everything else goes to stderr
+		std::cout.rdbuf(std::cerr.rdbuf());
+	}
+
 	cimg::exception_mode(0);
 
 	//detect any potential exceptions
 	try {
-		//Load the Image
-		CImg<unsigned short> img0(image_filename.c_str());
-		//Convert image to 8 bit
-		CImg<unsigned char> image_input = (img0 / (img0.max() > 255 ? 257 : 1));
-		//Display the image
-		CImgDisplay disp_input(image_input, "input");
-
 		//Part 3 - host operations
-		//3.1 Select computing devices
-		cl::Context context = GetContext(platform_id, device_id);
-		
-		//display the selected device
-		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
-		
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		//3.1 Select computing devices, 3.2 Load & build the device code
+		//This is only done once, however many images are processed
+		EqualizerSettings settings;
+		settings.engine = engine;
+		settings.platform_id = platform_id;
+		settings.device_id = device_id;
+		settings.numa = numa;
+		settings.scan = scanName;
+		settings.options.bin_size = bin_size;
+		settings.options.mode = mode;
+		settings.options.tile_width = tile_width;
+		settings.options.tile_height = tile_height;
+		settings.options.tile_depth = tile_depth;
+		settings.options.clip_limit = clip_limit;
+		settings.options.pack_images = pack_images;
+		settings.options.statistics = !statistics_filename.empty();
+		settings.options.percentiles = percentiles;
+		settings.options.stretch_low = stretch[0];
+		settings.options.stretch_high = stretch[1];
+		settings.reference_filename = reference_filename;
+		settings.model_spec = model_spec;
+		settings.hue_saturation = hue_saturation;
+		settings.cost_cache = cost_cache;
+		settings.verbose = verbose;
+		HistogramEqualizer equalizer(settings);
+
+		bool useDevice = equalizer.OnDevice();
+		const EqualizeOptions& options = equalizer.Options();
+		if (useDevice) {
+			//display the selected device
+			std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			if (numa) {
+				if (!equalizer.NumaNodes()) { std::cout << "The device cannot be split by NUMA node, running on the whole device" << std::endl; }
+				else { std::cout << "Split into " << equalizer.NumaNodes() << " NUMA node sub-devices" << std::endl; }
+			}
+		}
+		else {
+			if (!equalizer.FallbackReason().empty()) { std::cerr << "No OpenCL device available (" << equalizer.FallbackReason() << "), falling back to the CPU engine" << std::endl; }
+			std::cout << "Running on the CPU engine, " << equalizer.CpuThreads() << " thread(s)" << std::endl;
+			verify = false;
+		}
+
+		ofstream statistics_file;
+		if (options.statistics) {
+			statistics_file.open(statistics_filename);
+			WriteStatisticsHeader(statistics_file, percentiles);
+		}
+
+		//Event to track time for all operations to take place
+		cl::Event profEvent;
+
+		//Stream mode - frames are read from stdin and written to stdout until the stream ends
+		if (!stream_spec.empty()) {
+			auto start = std::chrono::steady_clock::now();
+			int frames = equalizer.EqualizeStream(stream_format, window, verbose);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cerr << "Streamed " << frames << " frame(s) in " << seconds << " s (" << (seconds > 0 ? frames / seconds : 0) << " frames/s)" << std::endl;
+			if (verbose && useDevice) { std::cerr << equalizer.PoolUsage() << std::endl; }
+			return 0;
+		}
+
+		//Daemon mode - the context, program, kernels and buffers above serve every request
+		if (!daemon_socket.empty()) {
+			fs::create_directories(output_dir);
+			std::cerr << "Serving on " << daemon_socket << ", writing files to " << output_dir << std::endl;
+			int served = equalizer.Serve(daemon_socket, output_dir, verbose);
+			std::cerr << "Served " << served << " image(s)" << std::endl;
+			if (useDevice) { std::cerr << equalizer.PoolUsage() << std::endl; }
+			return 0;
+		}
 
-		//3.2 Load & build the device code
-		cl::Program::Sources sources;
+		//Batch mode - every image reuses the context, program, kernels and buffers, results are written to the output directory.
+		//Decoding, transfers, kernels and encoding of neighbouring images overlap, see Pipeline.h
+		if (!batch_inputs.empty()) {
+			vector<string> files;
+			for (const string& input : batch_inputs) {
+				vector<string> listed = ListBatchInputs(input);
+				files.insert(files.end(), listed.begin(), listed.end());
+			}
+			fs::create_directories(output_dir);
+
+			auto start = std::chrono::steady_clock::now();
+			//A sliding window keeps the frames in order rather than pipelining them
+			int processed = equalizer.EqualizeBatch(files, output_dir, window, threads, verbose, &statistics_file);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			std::cout << "Processed " << processed << " of " << files.size() << " image(s) in " << seconds << " s ("
+				<< (seconds > 0 ? processed / seconds : 0) << " images/s)" << std::endl;
+			if (verbose && useDevice) { std::cout << equalizer.PoolUsage() << std::endl; }
+			return 0;
+		}
 
-		AddSources(sources, "kernels/my_kernels.cl");
+		//Multi-device mode, every device of the -A platforms (or every NUMA node of the -N device) equalizes a share of the image's rows
+		DeviceGroup group;
+		bool numaBands = useDevice && equalizer.NumaNodes() > 1 && mode == "global" && volume_spec.empty();
+		bool multiDevice = useDevice && (!multi_spec.empty() || numaBands);
+		if (multiDevice) {
+			group = equalizer.CreateGroup(numaBands ? "" : multi_spec);
+			for (size_t d = 0; d < group.states.size(); d++) {
+				std::cout << "Device " << d << ": " << group.states[d].device.getInfo<CL_DEVICE_NAME>() << ", " << group.bytes_per_us[d] << " [B/us]" << std::endl;
+			}
+		}
 
-		cl::Program program(context, sources);
+		//Headless mode writes the result rather than opening windows, so no X server is needed and nothing waits for the user
+		bool headless = !output_filename.empty();
 
-		//build and debug the kernel code
-		try {
-			program.build();
+		//Load the Image
+		CImg<unsigned char> image_input = volume_spec.empty() ? LoadImage8(image_filename) : LoadVolume(volume_spec);
+
+		//Region of interest histograms, every region in one launch
+		if (!roi_filename.empty()) {
+			vector<Roi> rois = LoadRois(roi_filename, image_input.width(), image_input.height());
+			if (rois.empty()) {
+				std::cerr << "ERROR: no regions in " << roi_filename << std::endl;
+				return 1;
+			}
+			vector<unsigned int> counts = equalizer.RoiHistograms(image_input, rois);
+			if (useDevice) { std::cout << rois.size() << " region histogram(s), " << GetFullProfilingInfo(equalizer.LastEvent(), ProfilingResolution::PROF_US) << std::endl; }
+			else { std::cout << rois.size() << " region histogram(s), CPU " << equalizer.LastHostUs() << " [us]" << std::endl; }
+			if (!sidecar_filename.empty()) { WriteRoiHistograms(sidecar_filename, rois, bin_size, counts); }
+			else {
+				for (size_t r = 0; r < rois.size(); r++) {
+					std::cout << "roi " << r << " (" << rois[r].x << "," << rois[r].y << " " << rois[r].width << "x" << rois[r].height << "): "
+						<< vector<unsigned int>(counts.begin() + r * bin_size, counts.begin() + (r + 1) * bin_size) << std::endl;
+				}
+			}
+			return 0;
 		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+
+		//Joint histogram, and with a second image the mutual information of every candidate shift of it
+		if (!joint_source.empty()) {
+			bool pairChannels = joint_source == "rg" || joint_source == "hs";
+			if (pairChannels && image_input.spectrum() < 3) {
+				std::cerr << "ERROR: " << joint_source << " joint histograms need a colour image" << std::endl;
+				return 1;
+			}
+			bool jointHueSaturation = joint_source == "hs";
+			CImg<unsigned char> first = jointHueSaturation ? image_input.get_channels(0, 2) : image_input.get_channel(0);
+			CImg<unsigned char> second = jointHueSaturation ? first : joint_source == "rg" ? image_input.get_channel(1) : LoadImage8(joint_source).get_channel(0);
+
+			JointHistograms joint;
+			joint.binsA = binsA;
+			joint.binsB = binsB;
+			joint.shifts = ShiftsWithin(pairChannels ? 0 : shift_radius);
+			equalizer.ComputeJointHistograms(first, second, jointHueSaturation, joint);
+			if (useDevice) { std::cout << joint.shifts.size() << " joint histogram(s), " << GetFullProfilingInfo(equalizer.LastEvent(), ProfilingResolution::PROF_US) << std::endl; }
+			else { std::cout << joint.shifts.size() << " joint histogram(s), CPU " << equalizer.LastHostUs() << " [us]" << std::endl; }
+
+			int best = joint.Best();
+			if (verbose) {
+				for (size_t c = 0; c < joint.shifts.size(); c++) {
+					std::cout << "shift " << joint.shifts[c].dx << "," << joint.shifts[c].dy << ": " << joint.mutual_information[c] << " [bits]" << std::endl;
+				}
+			}
+			std::cout << "Best shift " << joint.shifts[best].dx << "," << joint.shifts[best].dy << ", mutual information " << joint.mutual_information[best] << " [bits]" << std::endl;
+			if (!sidecar_filename.empty()) { WriteJointHistogram(sidecar_filename, joint, best); }
+			return 0;
 		}
+		//Display the image
+		CImgDisplay disp_input;
+		if (!headless) { disp_input.assign(image_input, "input"); }
 
 		//Part 4 - device operations
-		size_t vector_elements = bin_size;//number of elements
-		size_t vector_size = bin_size * sizeof(unsigned int);//size in bytes
-		size_t vector_size_char = bin_size * sizeof(unsigned char);//size in bytes
-		size_t picture_size = image_input.size() * sizeof(unsigned char); //size of picture in bytes
-		size_t single_int_size = sizeof(int);
-		//Get the maximum value of a pixel from the image
-		int maximumPixelIntensity = image_input.max();
+		//The histograms are only read back when they are printed or written out
+		Histograms histograms;
+		bool imageOnDevice = !multiDevice && equalizer.PrefersDevice(image_input.size());
+		bool readHistograms = !headless || !sidecar_filename.empty() || (options.statistics && !imageOnDevice);
+		CImg<unsigned char> output_image;
+		double host_us = 0;
+		vector<cl::Event> deviceDone;
+		if (equalizer.Model() && verbose) { std::cout << "Engine: " << equalizer.Model()->Describe(image_input.size()) << std::endl; }
+
+		//Volumes larger than a slab are streamed through the device, their histograms stay on it
+		vector<Slab> slabs;
+		if (imageOnDevice && !volume_spec.empty()) { slabs = equalizer.SlabsOf(image_input, slab_mb > 0 ? (size_t)slab_mb << 20 : 0); }
+		bool streamVolume = slabs.size() > 1;
+		if (streamVolume) {
+			if (!sidecar_filename.empty() || options.statistics) {
+				std::cerr << "ERROR: the histograms of a volume streamed in " << slabs.size() << " slabs are not read back, raise the slab size (-Z) for -x or -a" << std::endl;
+				return 1;
+			}
+			auto start = std::chrono::steady_clock::now();
+			output_image = equalizer.EqualizeSlabs(image_input, slabs);
+			host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		}
+		else if (multiDevice) {
+			auto start = std::chrono::steady_clock::now();
+			output_image = EqualizeMultiDevice(group, image_input, options, deviceDone, readHistograms ? &histograms : nullptr);
+			host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		}
+		else {
+			//The engine sends the image where imageOnDevice says
+			output_image = equalizer.Equalize(image_input, readHistograms ? &histograms : nullptr);
+			profEvent = equalizer.LastEvent();
+			host_us = equalizer.LastHostUs();
+		}
 
-		//Event to track time for all operations to take place
-		cl::Event profEvent;
+		//The CPU engine is the correctness reference for the kernels
+		if (verify && (imageOnDevice || multiDevice)) {
+			int max_difference = 0;
+			size_t mismatches = CompareImages(output_image, equalizer.EqualizeOnCpu(image_input), max_difference);
+			std::cout << "Verification against the CPU engine: " << mismatches << " of " << output_image.size() << " pixel(s) differ"
+				<< (mismatches ? ", by at most " + to_string(max_difference) : "") << std::endl;
+		}
 
-		//Vectors to contain values from the output of the buffers
-		std::vector<unsigned int> frequency_histogram(vector_elements);
-		std::vector<unsigned int> frequency_histogram1(vector_elements);
-		std::vector<unsigned int> frequency_histogram2(vector_elements);
-		std::vector<unsigned char> output_image_buffer(image_input.size());
-
-		//Padding Calculation
-		int numberToAdd = bin_size - (image_input.size() % bin_size); // Calculates the number of elements to pad by
-		if (numberToAdd == bin_size) { numberToAdd = 0; } // Sets number to add to 0, if it equals the number of bins
-		size_t padded_size = picture_size + (numberToAdd * sizeof(unsigned char));
-
-		//device - buffers
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, padded_size);//Padding 
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, picture_size);
-		cl::Buffer histogram_buffer(context, CL_MEM_READ_WRITE, vector_size);
-		cl::Buffer cumulative_buffer(context, CL_MEM_READ_WRITE, vector_size);
-		cl::Buffer normalized_hist_buffer(context, CL_MEM_READ_WRITE, vector_size_char);
-		cl::Buffer numOfBins(context, CL_MEM_READ_ONLY, single_int_size);
-		cl::Buffer maximumValue(context, CL_MEM_READ_ONLY, single_int_size);
-
-		//4.1 Copy data to device memory
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, picture_size, &image_input.data()[0], NULL, &profEvent);
-		queue.enqueueWriteBuffer(numOfBins, CL_TRUE, 0, single_int_size, &bin_size, NULL, &profEvent);
-		queue.enqueueWriteBuffer(maximumValue, CL_TRUE, 0, single_int_size, &maximumPixelIntensity, NULL, &profEvent);
-
-		//4.2 Setup the kernels (i.e. device code)
-		cl::Kernel histogramKern = cl::Kernel(program, "histogramVals"); //Kernel to calculate the histogram values
-		histogramKern.setArg(0, dev_image_input);
-		histogramKern.setArg(1, numOfBins);
-		histogramKern.setArg(2, maximumValue);
-		histogramKern.setArg(3, histogram_buffer);
-		histogramKern.setArg(4, cl::Local(vector_size));
-		
-		//Set the name of the scan kernel to use to allow for the user to choose what scan to enact
-		string scanKernel = "scan_bl";
-		if (scanName == "hs") {
-			scanKernel = "scan_hs";
-		}
-		else if (scanName == "si") {
-			scanKernel = "simpleScan";
-		}
-		if (!(bin_size & (bin_size - 1)) == 0 && scanKernel == "scan_bl") { scanKernel = "scan_hs"; cerr << "Running on Hillis-Steele due to bin size\n"; }
-
-		cl::Kernel cumulativeKern = cl::Kernel(program, scanKernel.c_str()); //Kernel to calculate cumulative histogram values
-		cumulativeKern.setArg(0, histogram_buffer);
-		cumulativeKern.setArg(1, cumulative_buffer);
-
-		cl::Kernel normalizeKern = cl::Kernel(program, "normHistogramVals"); //Kernel to normalize histogram values
-		if (scanKernel == "scan_bl") {
-			normalizeKern.setArg(0, histogram_buffer);
+		if (!headless) {
+			cerr << histograms.frequency << endl;
+			cerr << histograms.cumulative << endl;
+			cerr << vector<unsigned int>(histograms.normalized.begin(), histograms.normalized.end()) << endl;
+		}
+		if (!sidecar_filename.empty()) { WriteHistogramSidecar(sidecar_filename, histograms); }
+
+		//Statistics come from the histograms still on the device, only the small records are read back
+		if (options.statistics) {
+			vector<HistogramStatistics> statistics;
+			if (imageOnDevice) { statistics = equalizer.DeviceStatistics(image_input); }
+			else { statistics = ImageStatisticsOnHost(image_input, options, histograms); }
+			WriteStatisticsRows(statistics_file, image_filename, statistics, percentiles);
+			for (size_t c = 0; c < statistics.size(); c++) {
+				std::cout << "Statistics" << (statistics.size() > 1 ? " of channel " + to_string(c) : "") << ": mean " << statistics[c].mean << ", variance " << statistics[c].variance
+					<< ", entropy " << statistics[c].entropy << " [bits], median " << statistics[c].median << ", Otsu threshold " << statistics[c].otsu << std::endl;
+			}
+		}
+
+		//Output kernel time
+		if (streamVolume) {
+			std::cout << "\nStreamed " << slabs.size() << " slab(s), execution time [us]: " << host_us << std::endl;
+		}
+		else if (multiDevice) {
+			std::cout << "\nSplit across " << group.states.size() << " device(s), execution time [us]: " << host_us << std::endl;
+			for (size_t d = 0; d < deviceDone.size(); d++) {
+				if (deviceDone[d]()) { std::cout << "Device " << d << " map and read, " << GetFullProfilingInfo(deviceDone[d], ProfilingResolution::PROF_US) << std::endl; }
+			}
+		}
+		else if (imageOnDevice) {
+			std::cout << "\nKernel execution time [ns]:" <<
+				profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+				profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+			std::cout << GetFullProfilingInfo(profEvent, ProfilingResolution::PROF_US)
+				<< std::endl;
 		}
 		else {
-			normalizeKern.setArg(0, cumulative_buffer);
-		}
-		normalizeKern.setArg(1, maximumValue);
-		normalizeKern.setArg(2, normalized_hist_buffer);
-
-		cl::Kernel mapKern = cl::Kernel(program, "mapHistogram"); //Kernel to map histogram values
-		mapKern.setArg(0, dev_image_input);
-		mapKern.setArg(1, normalized_hist_buffer);
-		mapKern.setArg(2, maximumValue);
-		mapKern.setArg(3, numOfBins);
-		mapKern.setArg(4, dev_image_output);
-
-
-		//Run the kernels and read from the bufffers
-		//Kernel for calculating the histogram values
-		queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(image_input.size()+numberToAdd), cl::NDRange(vector_elements), NULL, &profEvent);
-		queue.enqueueReadBuffer(histogram_buffer, CL_TRUE, 0, vector_size, &frequency_histogram[0]);
-
-		//Removes the extra padded values from the intensity histogram, rewrites corrected answer back to the intensity histogram buffer
-		if (numberToAdd > 0) {
-			frequency_histogram[0] -= numberToAdd;
-			queue.enqueueWriteBuffer(histogram_buffer, CL_TRUE, 0, vector_size, &frequency_histogram[0], NULL, &profEvent);
-		}
-		cerr << frequency_histogram << endl;
-		//Kernel for calculating the cumulative histogram values
-		queue.enqueueNDRangeKernel(cumulativeKern, cl::NullRange, cl::NDRange(vector_elements), cl::NullRange, NULL, &profEvent);
-		queue.enqueueReadBuffer(cumulative_buffer, CL_TRUE, 0, vector_size, &frequency_histogram1[0]);
-		cerr << frequency_histogram1 << endl;
-		//Kernel for normalizing the histogram
-		queue.enqueueNDRangeKernel(normalizeKern, cl::NullRange, cl::NDRange(vector_elements), cl::NullRange, NULL, &profEvent);
-		//
-		queue.enqueueReadBuffer(normalized_hist_buffer, CL_TRUE, 0, vector_size, &frequency_histogram2[0]);
-		cerr << frequency_histogram2 << endl;
-		//Kernel for mapping the histogram to the image
-		queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &profEvent);
-		
-		//4.3 Copy the resulting image from device to host
-		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, picture_size, &output_image_buffer.data()[0], NULL, &profEvent);
-		//Create output image from data vector
-		CImg<unsigned char> output_image(output_image_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+			std::cout << "\nCPU execution time [us]: " << host_us << std::endl;
+		}
+
+		if (headless) {
+			SaveVolume(output_image, output_filename);
+			return 0;
+		}
+
 		//Display output image
 		CImgDisplay disp_output(output_image, "output");
 
-		//Output kernel time
-		std::cout << "\nKernel execution time [ns]:" <<
-			profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-			profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(profEvent, ProfilingResolution::PROF_US)
-			<< std::endl;
-
 		//Tells the application to wait until both images are closed
 		while (!disp_input.is_closed() && !disp_output.is_closed()
 			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
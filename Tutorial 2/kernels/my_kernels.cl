@@ -15,6 +15,11 @@ kernel void histogramVals(global const uchar* A, global const int* binSize, glob
 	}
 }
 
+//Removes the padded values (all zero, so all in the first bin) from the histogram
+kernel void unpadHistogram(global uint* B, const int padding) {
+	B[0] -= padding;
+}
+
 //Hillis-Steele basic inclusive scan
 //requires additional buffer B to avoid data overwrite 
 kernel void scan_hs(global uint* A, global uint* B) {
@@ -98,3 +103,683 @@ kernel void mapHistogram(global const uchar* A, global const uchar* B, global co
 	int binNum = (A[id] / (float)maximum[0]) * (binSize[0]-1);
 	C[id] = B[binNum];
 }
+
+//Clip points of the stretch mode from the cumulative histogram, one work item per bin.
+//The clip points are the lowest pixel value in the first bin to reach lowPermyriad of the pixels and the highest in the first bin to reach highPermyriad
+//(hundredths of a percent). Every item finds them, item 0 stores them and each item writes the stretched value of the lowest pixel value in its bin as the LUT.
+kernel void stretchLut(global const uint* A, global const int* maximum, global int* clip, global uchar* B, const int lowPermyriad, const int highPermyriad) {
+	int id = get_global_id(0);
+	int binSize = get_global_size(0);
+	ulong total = A[binSize-1];
+	int lowBin = binSize-1;
+	int highBin = binSize-1;
+	for (int i = binSize-1; i >= 0; i--) {
+		if ((ulong)A[i] * 10000 >= total * lowPermyriad) { lowBin = i; }
+		if ((ulong)A[i] * 10000 >= total * highPermyriad) { highBin = i; }
+	}
+	//Same bin calculation as histogramVals
+	int low = -1;
+	int high = 0;
+	int first = -1;
+	for (int v = 0; v <= maximum[0]; v++) {
+		int binNum = maximum[0] > 0 ? (int)((v / (float)maximum[0]) * (binSize-1)) : 0;
+		if (low < 0 && binNum >= lowBin) { low = v; }
+		if (binNum <= highBin) { high = v; }
+		if (first < 0 && binNum == id) { first = v; }
+	}
+	//A histogram with everything in one bin is left as it is
+	if (high <= low) { low = 0; high = 255; }
+	if (id == 0) {
+		clip[0] = low;
+		clip[1] = high;
+	}
+	B[id] = first < 0 ? 0 : clamp((first - low) * 255 / (high - low), 0, 255);
+}
+//Linear stretch between the clip points, same launch shape as mapHistogram
+kernel void mapStretch(global const uchar* A, global const int* clip, global uchar* C) {
+	int id = get_global_id(0);
+	int low = clip[0];
+	C[id] = clamp((A[id] - low) * 255 / (clip[1] - low), 0, 255);
+}
+
+//Per channel histograms of a planar image (CImg keeps each colour in its own plane), every plane in one pass.
+//Dimension 1 of the NDRange is the channel, dimension 0 is rounded up to whole work-groups so items past the end of the plane only help with the local histogram.
+kernel void histogramChannels(global const uchar* A, global const int* maxima, global uint* H, local uint* localH, const int planeSize, const int binSize) {
+	int id = get_global_id(0);
+	int c = get_global_id(1);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	//Reset Values in local memory
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	//Increment local histogram bins
+	if (id < planeSize) {
+		int bin_num = maxima[c] > 0 ? ((int)A[c * planeSize + id] / (float)maxima[c]) * (binSize - 1) : 0;
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	//Merge Local hist to this channel's global hist
+	for (int i = lid; i < binSize; i += lsize) {
+		if (localH[i] > 0) { atomic_add(&H[c * binSize + i], localH[i]); }
+	}
+}
+
+//Scans and normalizes every channel's histogram in one launch, one work-group per channel.
+//Each work item sums a run of bins, the run totals are scanned with Hillis-Steele in local memory and then added back into each run.
+kernel void scanChannels(global const uint* H, global const int* maxima, global uint* cumulative, global uchar* lut, local uint* scratch, const int binSize) {
+	int c = get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int run = (binSize + lsize - 1) / lsize;
+	int first = min(lid * run, binSize);
+	int last = min(first + run, binSize);
+	global const uint* hist = H + c * binSize;
+
+	uint total = 0;
+	for (int i = first; i < last; i++) { total += hist[i]; }
+	scratch[lid] = total;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//Inclusive Hillis-Steele over the run totals, scratch holds two buffers of lsize to avoid data overwrite
+	local uint* in = scratch;
+	local uint* out = scratch + lsize;
+	for (int stride = 1; stride < lsize; stride *= 2) {
+		out[lid] = in[lid] + (lid >= stride ? in[lid - stride] : 0);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		local uint* t = in; in = out; out = t;
+	}
+
+	uint sum = lid > 0 ? in[lid - 1] : 0;
+	uint count = in[lsize - 1];
+	for (int i = first; i < last; i++) {
+		sum += hist[i];
+		cumulative[c * binSize + i] = sum;
+		lut[c * binSize + i] = (int)((sum / (float)count) * maxima[c]);
+	}
+}
+
+//Maps every channel with its own LUT
+kernel void mapChannels(global const uchar* A, global const uchar* lut, global const int* maxima, global uchar* C, const int planeSize, const int binSize) {
+	int id = get_global_id(0);
+	int c = id / planeSize;
+	int binNum = maxima[c] > 0 ? (A[id] / (float)maxima[c]) * (binSize - 1) : 0;
+	C[id] = lut[c * binSize + binNum];
+}
+
+//Integer BT.601 luma, the weights add up to 256 so Y never exceeds the largest of R, G and B
+int luma(int r, int g, int b) {
+	return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+//Histogram of the luma of a planar RGB image, converted on the fly so Y is never stored.
+//Same layout as histogramVals, the global size is rounded up to whole work-groups and the extra items are skipped.
+kernel void histogramLuma(global const uchar* A, global const int* binSize, global const int* maximum, global uint* B, local uint* localH, const int planeSize) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	//Reset Values in local memory
+	localH[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	//Increment local histogram bins
+	if (id < planeSize) {
+		int y = luma(A[id], A[planeSize + id], A[2 * planeSize + id]);
+		int bin_num = (y / (float)maximum[0]) * (binSize[0] - 1);
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	//Merge Local hist to global hist
+	if (lid < binSize[0]) {
+		atomic_add(&B[lid], localH[lid]);
+	}
+}
+
+//Maps the luma of every pixel and converts back to RGB in the same pass.
+//Cb and Cr are unchanged, so converting back only adds the change in Y to each of R, G and B.
+kernel void mapLuma(global const uchar* A, global const uchar* B, global const int* maximum, global const int* binSize, global uchar* C, const int planeSize) {
+	int id = get_global_id(0);
+	int r = A[id];
+	int g = A[planeSize + id];
+	int b = A[2 * planeSize + id];
+	int y = luma(r, g, b);
+	int binNum = (y / (float)maximum[0]) * (binSize[0] - 1);
+	int dy = B[binNum] - y;
+	C[id] = clamp(r + dy, 0, 255);
+	C[planeSize + id] = clamp(g + dy, 0, 255);
+	C[2 * planeSize + id] = clamp(b + dy, 0, 255);
+}
+
+//CLAHE, pass 1: the histogram of every tile of every plane in one launch, one work-group per tile.
+//Each group owns its tile's histogram, so it is written out without global atomics.
+kernel void claheHistograms(global const uchar* A, global uint* H, local uint* localH, const int width, const int height, const int tileW, const int tileH, const int tilesX, const int tilesY, const int binSize, const int maximum) {
+	int tile = get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int tx = tile % tilesX;
+	int ty = (tile / tilesX) % tilesY;
+	int c = tile / (tilesX * tilesY);
+	int x0 = tx * tileW;
+	int y0 = ty * tileH;
+	int w = min(tileW, width - x0);
+	int h = min(tileH, height - y0);
+	global const uchar* plane = A + (size_t)c * width * height;
+
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < w * h; i += lsize) {
+		int v = plane[(y0 + i / w) * width + x0 + i % w];
+		int bin_num = maximum > 0 ? (v / (float)maximum) * (binSize - 1) : 0;
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < binSize; i += lsize) { H[tile * binSize + i] = localH[i]; }
+}
+
+//CLAHE, pass 2: clips every tile histogram, redistributes the excess evenly, then scans and normalizes it into the tile's LUT.
+//One work item per tile, the clip limit is a multiple of the average bin count in 1/256 steps so it stays integer.
+kernel void claheLuts(global uint* H, global uint* cumulative, global uchar* lut, const int tiles, const int binSize, const int clipLimit256, const int maximum) {
+	int tile = get_global_id(0);
+	if (tile >= tiles) { return; }
+	global uint* hist = H + tile * binSize;
+
+	uint total = 0;
+	for (int i = 0; i < binSize; i++) { total += hist[i]; }
+	uint clip = max((uint)(((ulong)clipLimit256 * total) / (256 * (ulong)binSize)), 1u);
+
+	uint excess = 0;
+	for (int i = 0; i < binSize; i++) {
+		if (hist[i] > clip) { excess += hist[i] - clip; hist[i] = clip; }
+	}
+	uint batch = excess / binSize;
+	uint residual = excess % binSize;
+	for (int i = 0; i < binSize; i++) { hist[i] += batch; }
+	if (residual > 0) {
+		int step = max(binSize / (int)residual, 1);
+		for (int i = 0; i < binSize && residual > 0; i += step, residual--) { hist[i]++; }
+	}
+
+	uint sum = 0;
+	for (int i = 0; i < binSize; i++) {
+		sum += hist[i];
+		cumulative[tile * binSize + i] = sum;
+		lut[tile * binSize + i] = (int)((sum / (float)total) * maximum);
+	}
+}
+
+//CLAHE, pass 3: every pixel blends the LUTs of the four nearest tile centres bilinearly.
+//Positions are in half pixels so the weights, and so the result, are exact integers.
+kernel void claheMap(global const uchar* A, global const uchar* lut, global uchar* C, const int width, const int height, const int tileW, const int tileH, const int tilesX, const int tilesY, const int binSize, const int maximum) {
+	int id = get_global_id(0);
+	int x = id % width;
+	int y = (id / width) % height;
+	int c = id / (width * height);
+	int v = A[id];
+	int binNum = maximum > 0 ? (v / (float)maximum) * (binSize - 1) : 0;
+
+	//Offset from the centre of the tile up and to the left, in half pixels
+	int fx = 2 * x + 1 - tileW;
+	int fy = 2 * y + 1 - tileH;
+	int tx0 = fx < 0 ? 0 : min(fx / (2 * tileW), tilesX - 1);
+	int ty0 = fy < 0 ? 0 : min(fy / (2 * tileH), tilesY - 1);
+	int tx1 = min(tx0 + 1, tilesX - 1);
+	int ty1 = min(ty0 + 1, tilesY - 1);
+	long wx = clamp(fx - tx0 * 2 * tileW, 0, 2 * tileW);
+	long wy = clamp(fy - ty0 * 2 * tileH, 0, 2 * tileH);
+	long spanX = 2 * tileW;
+	long spanY = 2 * tileH;
+
+	global const uchar* planeLut = lut + (size_t)c * tilesX * tilesY * binSize;
+	long l00 = planeLut[(ty0 * tilesX + tx0) * binSize + binNum];
+	long l10 = planeLut[(ty0 * tilesX + tx1) * binSize + binNum];
+	long l01 = planeLut[(ty1 * tilesX + tx0) * binSize + binNum];
+	long l11 = planeLut[(ty1 * tilesX + tx1) * binSize + binNum];
+	long blended = l00 * (spanX - wx) * (spanY - wy) + l10 * wx * (spanY - wy) + l01 * (spanX - wx) * wy + l11 * wx * wy;
+	C[id] = (blended + spanX * spanY / 2) / (spanX * spanY);
+}
+
+//Volumetric CLAHE, pass 1: one work-group per box shaped tile, claheLuts then clips them as in 2D.
+//A plane is a width x height slice of one channel (plane c * depth + z) and A holds whole planes from plane size.w on, so a volume
+//too large for the device can be processed a slab of tile layers at a time. size is (width, height, depth, first plane),
+//tile the tile size and tiles (tilesX, tilesY, tilesZ, first tile of the launch).
+kernel void claheHistograms3D(global const uchar* A, global uint* H, local uint* localH, const int4 size, const int4 tile, const int4 tiles, const int binSize, const int maximum) {
+	int t = tiles.w + get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int tx = t % tiles.x;
+	int ty = (t / tiles.x) % tiles.y;
+	int tz = (t / (tiles.x * tiles.y)) % tiles.z;
+	int c = t / (tiles.x * tiles.y * tiles.z);
+	int x0 = tx * tile.x;
+	int y0 = ty * tile.y;
+	int z0 = tz * tile.z;
+	int w = min(tile.x, size.x - x0);
+	int h = min(tile.y, size.y - y0);
+	int d = min(tile.z, size.z - z0);
+	global const uchar* first = A + ((size_t)(c * size.z + z0) - size.w) * size.x * size.y;
+
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < w * h * d; i += lsize) {
+		int z = i / (w * h);
+		int y = y0 + (i / w) % h;
+		int x = x0 + i % w;
+		int v = first[((size_t)z * size.y + y) * size.x + x];
+		int bin_num = maximum > 0 ? (v / (float)maximum) * (binSize - 1) : 0;
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < binSize; i += lsize) { H[t * binSize + i] = localH[i]; }
+}
+
+//Volumetric CLAHE, pass 3: every voxel of a run of planes from size.w on blends the LUTs of the eight nearest tile centres trilinearly.
+//Positions are in half voxels as in claheMap.
+kernel void claheMap3D(global const uchar* A, global const uchar* lut, global uchar* C, const int4 size, const int4 tile, const int4 tiles, const int binSize, const int maximum) {
+	int id = get_global_id(0);
+	int planeSize = size.x * size.y;
+	int p = size.w + id / planeSize;
+	int x = id % size.x;
+	int y = (id % planeSize) / size.x;
+	int z = p % size.z;
+	int c = p / size.z;
+	int v = A[id];
+	int binNum = maximum > 0 ? (v / (float)maximum) * (binSize - 1) : 0;
+
+	int fx = 2 * x + 1 - tile.x;
+	int fy = 2 * y + 1 - tile.y;
+	int fz = 2 * z + 1 - tile.z;
+	int tx0 = fx < 0 ? 0 : min(fx / (2 * tile.x), tiles.x - 1);
+	int ty0 = fy < 0 ? 0 : min(fy / (2 * tile.y), tiles.y - 1);
+	int tz0 = fz < 0 ? 0 : min(fz / (2 * tile.z), tiles.z - 1);
+	int tx1 = min(tx0 + 1, tiles.x - 1);
+	int ty1 = min(ty0 + 1, tiles.y - 1);
+	int tz1 = min(tz0 + 1, tiles.z - 1);
+	long wx = clamp(fx - tx0 * 2 * tile.x, 0, 2 * tile.x);
+	long wy = clamp(fy - ty0 * 2 * tile.y, 0, 2 * tile.y);
+	long wz = clamp(fz - tz0 * 2 * tile.z, 0, 2 * tile.z);
+	long spanX = 2 * tile.x;
+	long spanY = 2 * tile.y;
+	long spanZ = 2 * tile.z;
+
+	global const uchar* channelLut = lut + (size_t)c * tiles.x * tiles.y * tiles.z * binSize;
+	global const uchar* lower = channelLut + (size_t)tz0 * tiles.x * tiles.y * binSize;
+	global const uchar* upper = channelLut + (size_t)tz1 * tiles.x * tiles.y * binSize;
+	long l00 = lower[(ty0 * tiles.x + tx0) * binSize + binNum];
+	long l10 = lower[(ty0 * tiles.x + tx1) * binSize + binNum];
+	long l01 = lower[(ty1 * tiles.x + tx0) * binSize + binNum];
+	long l11 = lower[(ty1 * tiles.x + tx1) * binSize + binNum];
+	long u00 = upper[(ty0 * tiles.x + tx0) * binSize + binNum];
+	long u10 = upper[(ty0 * tiles.x + tx1) * binSize + binNum];
+	long u01 = upper[(ty1 * tiles.x + tx0) * binSize + binNum];
+	long u11 = upper[(ty1 * tiles.x + tx1) * binSize + binNum];
+	long lowerBlend = l00 * (spanX - wx) * (spanY - wy) + l10 * wx * (spanY - wy) + l01 * (spanX - wx) * wy + l11 * wx * wy;
+	long upperBlend = u00 * (spanX - wx) * (spanY - wy) + u10 * wx * (spanY - wy) + u01 * (spanX - wx) * wy + u11 * wx * wy;
+	long blended = lowerBlend * (spanZ - wz) + upperBlend * wz;
+	long span = spanX * spanY * spanZ;
+	C[id] = (blended + span / 2) / span;
+}
+
+//Histogram specification, every bin binary searches the reference CDF for the first reference bin that reaches its own CDF.
+//The CDFs are compared as cross products of the counts so nothing is rounded.
+kernel void matchHistogram(global const uint* A, global const uint* reference, global uchar* B, const int referenceBins, const int referenceMaximum) {
+	int id = get_global_id(0);
+	int size = get_global_size(0);
+	ulong count = A[id];
+	ulong total = A[size - 1];
+	ulong referenceTotal = reference[referenceBins - 1];
+
+	int lo = 0;
+	int hi = referenceBins - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (reference[mid] * total >= count * referenceTotal) { hi = mid; }
+		else { lo = mid + 1; }
+	}
+	//Lowest pixel value falling in that reference bin
+	B[id] = referenceBins > 1 ? (int)((lo / (float)(referenceBins - 1)) * referenceMaximum) : referenceMaximum;
+}
+
+//Sliding window, takes the oldest frame's histogram out of the running sum and clears its slot in the ring for the newest frame
+kernel void windowRetire(global uint* ring, global uint* sum, const int slot) {
+	int id = get_global_id(0);
+	int binSize = get_global_size(0);
+	sum[id] -= ring[slot * binSize + id];
+	ring[slot * binSize + id] = 0;
+}
+
+//Sliding window, histogram of the newest frame added both to its slot in the ring and to the running sum.
+//Values are binned over the full 0-255 range so the histograms of different frames line up.
+kernel void histogramWindow(global const uchar* A, global uint* ring, global uint* sum, local uint* localH, const int size, const int binSize, const int slot) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (id < size) {
+		int bin_num = (A[id] / 255.0f) * (binSize - 1);
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < binSize; i += lsize) {
+		if (localH[i] > 0) {
+			atomic_add(&ring[slot * binSize + i], localH[i]);
+			atomic_add(&sum[i], localH[i]);
+		}
+	}
+}
+
+//Histograms of many regions of interest in one launch, read straight from the full frame.
+//Dimensions 0 and 1 of the NDRange cover a region (looping when it is larger than the range), dimension 2 picks it from rois,
+//four ints per region: x, y, width, height. pitch is the row length and planeStride the distance between colour planes.
+kernel void histogramRois(global const uchar* A, global const int* rois, global uint* H, local uint* localH, const int pitch, const int planeStride, const int channels, const int binSize, const int maximum) {
+	int r = get_global_id(2);
+	int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int lsize = get_local_size(0) * get_local_size(1);
+	int x0 = rois[4 * r];
+	int y0 = rois[4 * r + 1];
+	int w = rois[4 * r + 2];
+	int h = rois[4 * r + 3];
+
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int c = 0; c < channels; c++) {
+		for (int y = get_global_id(1); y < h; y += get_global_size(1)) {
+			global const uchar* row = A + c * planeStride + (y0 + y) * pitch + x0;
+			for (int x = get_global_id(0); x < w; x += get_global_size(0)) {
+				int bin_num = maximum > 0 ? (row[x] / (float)maximum) * (binSize - 1) : 0;
+				atomic_inc(&localH[bin_num]);
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < binSize; i += lsize) {
+		if (localH[i] > 0) { atomic_add(&H[r * binSize + i], localH[i]); }
+	}
+}
+
+//Packed batches of small images: A holds the images back to back, image i spans offsets[i] to offsets[i + 1].
+//Work-groups are assigned to images by the host, groups holds the image and first pixel of every work-group's chunk and
+//chunks never cross an image, so each group builds one local histogram and merges it into its own image's histogram.
+kernel void histogramPacked(global const uchar* A, global const uint* offsets, global const int* groups, global const int* maxima, global uint* H, local uint* localH, const int chunk, const int binSize) {
+	int g = get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int image = groups[2 * g];
+	uint begin = groups[2 * g + 1];
+	uint end = min(begin + chunk, offsets[image + 1]);
+	int maximum = maxima[image];
+
+	for (int i = lid; i < binSize; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = begin + lid; i < end; i += lsize) {
+		int bin_num = maximum > 0 ? (A[i] / (float)maximum) * (binSize - 1) : 0;
+		atomic_inc(&localH[bin_num]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < binSize; i += lsize) {
+		if (localH[i] > 0) { atomic_add(&H[image * binSize + i], localH[i]); }
+	}
+}
+
+//Maps a packed batch, the same work-group to chunk assignment as histogramPacked, every image with its own LUT from scanChannels
+kernel void mapPacked(global const uchar* A, global const uint* offsets, global const int* groups, global const int* maxima, global const uchar* lut, global uchar* C, const int chunk, const int binSize) {
+	int g = get_group_id(0);
+	int image = groups[2 * g];
+	uint begin = groups[2 * g + 1];
+	uint end = min(begin + chunk, offsets[image + 1]);
+	int maximum = maxima[image];
+	global const uchar* imageLut = lut + image * binSize;
+
+	for (uint i = begin + get_local_id(0); i < end; i += get_local_size(0)) {
+		int binNum = maximum > 0 ? (A[i] / (float)maximum) * (binSize - 1) : 0;
+		C[i] = imageLut[binNum];
+	}
+}
+
+//Integer HSV hue (0-359) and saturation (0-255), so the host gets exactly the same bins
+int hue(int r, int g, int b) {
+	int hi = max(r, max(g, b));
+	int d = hi - min(r, min(g, b));
+	if (d == 0) { return 0; }
+	if (hi == r) {
+		int h = (60 * (g - b)) / d;
+		return h < 0 ? h + 360 : h;
+	}
+	if (hi == g) { return 120 + (60 * (b - r)) / d; }
+	return 240 + (60 * (r - g)) / d;
+}
+
+int saturation(int r, int g, int b) {
+	int hi = max(r, max(g, b));
+	return hi > 0 ? (255 * (hi - min(r, min(g, b)))) / hi : 0;
+}
+
+//Hue-saturation bin of a pixel in a binSize x binSize histogram
+int hueSaturationBin(int r, int g, int b, int binSize) {
+	return (hue(r, g, b) * binSize / 360) * binSize + saturation(r, g, b) * binSize / 256;
+}
+
+//Histogram back-projection, each pixel's bin is computed and looked up in the model likelihood in the same pass.
+//Intensity bins (luma for RGB) cover the full 0-255 range so frames and the model line up whatever their maxima.
+kernel void backProject(global const uchar* A, global const uchar* likelihood, global uchar* C, const int planeSize, const int channels, const int binSize, const int hueSaturation) {
+	int id = get_global_id(0);
+	int r = A[id];
+	int g = channels >= 3 ? A[planeSize + id] : r;
+	int b = channels >= 3 ? A[2 * planeSize + id] : r;
+	int binNum;
+	if (hueSaturation) { binNum = hueSaturationBin(r, g, b, binSize); }
+	else { binNum = ((channels >= 3 ? luma(r, g, b) : r) / 255.0f) * (binSize - 1); }
+	C[id] = likelihood[binNum];
+}
+
+//Joint histograms, binsA x binsB bins (row a, column b) per candidate shift.
+//Pixel (x, y) of plane A is paired with pixel (x + dx, y + dy) of plane B, pairs falling outside B are not counted.
+//With hueSaturation set A is a planar RGB image and each pixel is paired with itself as hue x saturation instead.
+//The dimensions are packed as (width, height, widthB, heightB) and the bins as (binsA, binsB, maxA, maxB).
+int jointBin(global const uchar* A, global const uchar* B, int id, int dx, int dy, int4 size, int4 bins, int hueSaturation) {
+	int x = id % size.x;
+	int y = id / size.x;
+	if (hueSaturation) {
+		int planeSize = size.x * size.y;
+		int r = A[id];
+		int g = A[planeSize + id];
+		int b = A[2 * planeSize + id];
+		return (hue(r, g, b) * bins.x / 360) * bins.y + saturation(r, g, b) * bins.y / 256;
+	}
+	int xb = x + dx;
+	int yb = y + dy;
+	if (xb < 0 || yb < 0 || xb >= size.z || yb >= size.w) { return -1; }
+	int a = bins.z > 0 ? (A[id] / (float)bins.z) * (bins.x - 1) : 0;
+	int b = bins.w > 0 ? (B[yb * size.z + xb] / (float)bins.w) * (bins.y - 1) : 0;
+	return a * bins.y + b;
+}
+
+//Local memory privatization, used when a whole joint histogram fits in local memory.
+//Dimension 0 is a fixed number of work-groups per candidate striding over the pixels of A, so each local histogram is cleared and merged
+//once for many pixels, dimension 1 the candidate shifts. Every work-group merges into its own candidate's histogram.
+kernel void histogramJoint(global const uchar* A, global const uchar* B, global const int* shifts, global uint* H, local uint* localH, const int4 size, const int4 bins, const int hueSaturation) {
+	int c = get_global_id(1);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int stride = get_global_size(0);
+	int pixels = size.x * size.y;
+	int jointBins = bins.x * bins.y;
+	int dx = shifts[2 * c];
+	int dy = shifts[2 * c + 1];
+
+	for (int i = lid; i < jointBins; i += lsize) { localH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int id = get_global_id(0); id < pixels; id += stride) {
+		int bin = jointBin(A, B, id, dx, dy, size, bins, hueSaturation);
+		if (bin >= 0) { atomic_inc(&localH[bin]); }
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < jointBins; i += lsize) {
+		if (localH[i] > 0) { atomic_add(&H[c * jointBins + i], localH[i]); }
+	}
+}
+
+//Global fallback for joint histograms too large for local memory. Each candidate has shardCount copies of its histogram and
+//work-groups take turns between them, so fewer items contend for the same global counters. reduceJointShards then adds the copies.
+//The candidates are run in chunks starting at first, the shards only hold the chunk's.
+kernel void histogramJointSharded(global const uchar* A, global const uchar* B, global const int* shifts, global uint* shards, const int4 size, const int4 bins, const int hueSaturation, const int shardCount, const int first) {
+	int id = get_global_id(0);
+	int chunk_c = get_global_id(1);
+	int c = first + chunk_c;
+	int jointBins = bins.x * bins.y;
+	if (id >= size.x * size.y) { return; }
+	int bin = jointBin(A, B, id, shifts[2 * c], shifts[2 * c + 1], size, bins, hueSaturation);
+	if (bin >= 0) { atomic_inc(&shards[(chunk_c * shardCount + get_group_id(0) % shardCount) * jointBins + bin]); }
+}
+
+kernel void reduceJointShards(global const uint* shards, global uint* H, const int jointBins, const int shardCount, const int first) {
+	int id = get_global_id(0);
+	int c = id / jointBins;
+	int i = id % jointBins;
+	uint sum = 0;
+	for (int s = 0; s < shardCount; s++) { sum += shards[(c * shardCount + s) * jointBins + i]; }
+	H[first * jointBins + id] = sum;
+}
+
+//Mutual information in bits of every candidate's joint histogram, one work-group per candidate.
+//The marginals are summed into local memory, then every item adds up its share of the cells and the shares are reduced as a tree,
+//so the work-group size has to be a power of 2.
+kernel void mutualInformation(global const uint* H, global float* MI, local uint* marginals, local float* partial, const int binsA, const int binsB) {
+	int c = get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	global const uint* joint = H + c * binsA * binsB;
+
+	for (int a = lid; a < binsA; a += lsize) {
+		uint sum = 0;
+		for (int b = 0; b < binsB; b++) { sum += joint[a * binsB + b]; }
+		marginals[a] = sum;
+	}
+	for (int b = lid; b < binsB; b += lsize) {
+		uint sum = 0;
+		for (int a = 0; a < binsA; a++) { sum += joint[a * binsB + b]; }
+		marginals[binsA + b] = sum;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint total = 0;
+	for (int a = 0; a < binsA; a++) { total += marginals[a]; }
+	float sum = 0;
+	for (int i = lid; i < binsA * binsB; i += lsize) {
+		uint n = joint[i];
+		if (n > 0) { sum += n * log2(((float)n * total) / ((float)marginals[i / binsB] * marginals[binsA + i % binsB])); }
+	}
+	partial[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int stride = lsize / 2; stride > 0; stride /= 2) {
+		if (lid < stride) { partial[lid] += partial[lid + stride]; }
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0) { MI[c] = total > 0 ? partial[0] / total : 0; }
+}
+
+//Statistics of one histogram, read back instead of the histogram itself, same layout as HistogramStatistics on the host.
+//Values are pixel intensities, bin i standing for i * maximum / (binSize - 1).
+typedef struct {
+	uint count;
+	float mean;
+	float variance;
+	float entropy; //Shannon entropy in bits
+	float median;
+	float otsu; //Otsu's threshold, bins up to it are the background class
+	float percentiles[8];
+} Statistics;
+
+//Sums scratch[0..lsize) and scratch[lsize..2 * lsize) as trees, lsize has to be a power of 2
+void reducePairs(local float* scratch, int lid, int lsize) {
+	for (int stride = lsize / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			scratch[lid] += scratch[lid + stride];
+			scratch[lsize + lid] += scratch[lsize + lid + stride];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+//One work-group per histogram. Only the cumulative histogram is read, the frequencies are its differences, so it works after
+//any of the scans. Percentiles are given in hundredths of a percent and are the first bin whose cumulative count reaches them.
+kernel void histogramStatistics(global const uint* cumulative, global const int* maxima, global Statistics* stats, local float* scratch, global const int* percentiles, const int percentileCount, const int binSize) {
+	int c = get_group_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	global const uint* cum = cumulative + c * binSize;
+	global Statistics* out = stats + c;
+	uint total = cum[binSize - 1];
+	float scale = binSize > 1 ? maxima[c] / (float)(binSize - 1) : 0;
+
+	//Mean and entropy
+	float sum = 0;
+	float entropy = 0;
+	for (int i = lid; i < binSize; i += lsize) {
+		uint f = cum[i] - (i > 0 ? cum[i - 1] : 0);
+		sum += f * (i * scale);
+		if (f > 0) {
+			float p = f / (float)total;
+			entropy -= p * log2(p);
+		}
+	}
+	scratch[lid] = sum;
+	scratch[lsize + lid] = entropy;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	reducePairs(scratch, lid, lsize);
+	float mean = total > 0 ? scratch[0] / total : 0;
+	entropy = scratch[lsize];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//Variance, a second pass around the mean
+	float squares = 0;
+	for (int i = lid; i < binSize; i += lsize) {
+		uint f = cum[i] - (i > 0 ? cum[i - 1] : 0);
+		float d = i * scale - mean;
+		squares += f * d * d;
+	}
+	scratch[lid] = squares;
+	scratch[lsize + lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	reducePairs(scratch, lid, lsize);
+	if (lid == 0) {
+		out->count = total;
+		out->mean = mean;
+		out->variance = total > 0 ? scratch[0] / total : 0;
+		out->entropy = entropy;
+	}
+
+	//Exactly one bin is the first to reach each fraction, the median is the 50% one
+	for (int i = lid; i < binSize; i += lsize) {
+		for (int p = 0; p <= percentileCount; p++) {
+			ulong target = (ulong)(p < percentileCount ? percentiles[p] : 5000) * total;
+			bool reaches = (ulong)cum[i] * 10000 >= target;
+			bool before = i > 0 && (ulong)cum[i - 1] * 10000 >= target;
+			if (reaches && !before) {
+				if (p < percentileCount) { out->percentiles[p] = i * scale; }
+				else { out->median = i * scale; }
+			}
+		}
+	}
+
+	//Otsu's threshold, a short serial pass over the bins maximizing the between-class variance
+	if (lid == 0) {
+		ulong weighted = 0;
+		for (int i = 0; i < binSize; i++) { weighted += (ulong)i * (cum[i] - (i > 0 ? cum[i - 1] : 0)); }
+		float meanBin = weighted / (float)total;
+		ulong below = 0;
+		float best = -1;
+		int threshold = 0;
+		for (int t = 0; t < binSize; t++) {
+			below += (ulong)t * (cum[t] - (t > 0 ? cum[t - 1] : 0));
+			if (cum[t] == 0 || cum[t] == total) { continue; }
+			float w = cum[t] / (float)total;
+			float d = meanBin * w - below / (float)total;
+			float between = d * d / (w * (1 - w));
+			if (between > best) {
+				best = between;
+				threshold = t;
+			}
+		}
+		out->otsu = threshold * scale;
+	}
+}
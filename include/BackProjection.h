@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+
+namespace histeq {
+
+//Builds the model histogram of the backproject mode from a template image, "file" or "file@x,y,width,height" to use only a region of it.
+//The model is built once on the host, the template is small, and uploaded once so every frame only runs the fused backProject kernel.
+inline shared_ptr<const ModelHistogram> LoadModelHistogram(const string& spec, DeviceState* state, bool hue_saturation, int bin_size) {
+	string filename = spec;
+	Roi roi;
+	size_t at = spec.rfind('@');
+	bool cropped = at != string::npos && sscanf(spec.c_str() + at + 1, "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) == 4;
+	if (cropped) { filename = spec.substr(0, at); }
+
+	CImg<unsigned char> image = LoadImage8(filename);
+	if (cropped) {
+		int x1 = min(roi.x + roi.width, image.width()) - 1;
+		int y1 = min(roi.y + roi.height, image.height()) - 1;
+		roi.x = max(roi.x, 0);
+		roi.y = max(roi.y, 0);
+		if (x1 < roi.x || y1 < roi.y) { throw CImgArgumentException("model region %s lies outside the %dx%d template", spec.c_str(), image.width(), image.height()); }
+		image.crop(roi.x, roi.y, x1, y1);
+	}
+
+	shared_ptr<ModelHistogram> model = make_shared<ModelHistogram>();
+	model->hue_saturation = hue_saturation;
+	model->bin_size = bin_size;
+	model->frequency.assign(hue_saturation ? bin_size * bin_size : bin_size, 0);
+
+	bool rgb = image.spectrum() >= 3;
+	size_t planeSize = image.size() / image.spectrum();
+	const unsigned char* r = image.data();
+	const unsigned char* g = rgb ? r + planeSize : r;
+	const unsigned char* b = rgb ? r + 2 * planeSize : r;
+	for (size_t i = 0; i < planeSize; i++) {
+		model->frequency[CpuEngine::BackProjectionBin(r[i], g[i], b[i], rgb, bin_size, hue_saturation)]++;
+	}
+
+	unsigned int peak = *max_element(model->frequency.begin(), model->frequency.end());
+	model->likelihood.resize(model->frequency.size());
+	for (size_t i = 0; i < model->frequency.size(); i++) {
+		model->likelihood[i] = peak > 0 ? (unsigned char)(((unsigned long long)model->frequency[i] * 255) / peak) : 0;
+	}
+
+	if (state) {
+		model->buffer = cl::Buffer(state->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, model->likelihood.size(), model->likelihood.data());
+	}
+	return model;
+}
+
+} //namespace histeq
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace histeq {
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+//Image types picked up when a whole directory is given
+inline bool IsImageFile(const fs::path& path) {
+	string ext = path.extension().string();
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext == ".pgm" || ext == ".ppm" || ext == ".pnm" || ext == ".bmp" || ext == ".png" || ext == ".jpg" || ext == ".jpeg";
+}
+
+//Matches a file name against a pattern containing * and ? wildcards
+inline bool MatchWildcard(const char* pattern, const char* name) {
+	if (*pattern == '\0') { return *name == '\0'; }
+	if (*pattern == '*') { return MatchWildcard(pattern + 1, name) || (*name != '\0' && MatchWildcard(pattern, name + 1)); }
+	if (*name != '\0' && (*pattern == '?' || *pattern == *name)) { return MatchWildcard(pattern + 1, name + 1); }
+	return false;
+}
+
+//Expands a batch input into image file names, the input can be:
+//	1.	A directory - every image inside it
+//	2.	A pattern - e.g. images/*.pgm, as the Windows command line does not expand these for us
+//	3.	A text file - one image file name per line
+inline vector<string> ListBatchInputs(const string& input) {
+	vector<string> files;
+	fs::path path(input);
+
+	if (fs::is_directory(path)) {
+		for (const auto& entry : fs::directory_iterator(path)) {
+			if (entry.is_regular_file() && IsImageFile(entry.path())) { files.push_back(entry.path().string()); }
+		}
+	}
+	else if (input.find_first_of("*?") != string::npos) {
+		fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+		string pattern = path.filename().string();
+		for (const auto& entry : fs::directory_iterator(dir)) {
+			if (entry.is_regular_file() && MatchWildcard(pattern.c_str(), entry.path().filename().string().c_str())) { files.push_back(entry.path().string()); }
+		}
+	}
+	else {
+		ifstream list(input);
+		if (!list) { cerr << "ERROR: Cannot open batch input " << input << endl; }
+		string line;
+		while (getline(list, line)) {
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if (!line.empty()) { files.push_back(line); }
+		}
+		return files;
+	}
+
+	sort(files.begin(), files.end());
+	return files;
+}
+
+//Output file name for an input, keeps the input's name and format but places it in the output directory
+inline string BatchOutputName(const string& output_dir, const string& input) {
+	return (fs::path(output_dir) / fs::path(input).filename()).string();
+}
+
+} //namespace histeq
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Utils.h"
+
+namespace histeq {
+
+using namespace std;
+
+//Device and pinned host buffers handed out by size class, the next power of two of the size asked for, and kept for reuse once given back.
+//Images a little larger than the last one, or a bin count switching back and forth, then find a buffer waiting instead of paying for
+//an allocation (milliseconds on some runtimes). A request takes a free buffer of its own class, or else the smallest free one at most
+//max_oversize times larger. Buffers are only reused with the same context, device and flags, so NUMA nodes sharing a context keep to
+//the memory their buffers were first touched on. Free buffers beyond the free limit are let go, largest first, so a long running
+//daemon does not hold on to every size it has ever seen.
+class BufferPool {
+public:
+	static const size_t default_free_limit = (size_t)256 << 20;
+	static const size_t max_oversize = 4;
+
+	explicit BufferPool(size_t free_limit = default_free_limit) : free_limit(free_limit) {}
+
+	//A buffer of at least bytes, one given back earlier when there is one. device is the device the buffer is used on, NULL when it is
+	//not tied to one device of the context.
+	cl::Buffer Acquire(const cl::Context& context, cl_device_id device, cl_mem_flags flags, size_t bytes) {
+		size_t size = SizeClass(bytes);
+		Key key = make_tuple(context(), device, flags, size);
+		lock_guard<mutex> lock(guard);
+		requests++;
+		for (auto it = free_buffers.lower_bound(key); it != free_buffers.end() && SameKind(it->first, key) && get<3>(it->first) <= size * max_oversize; ++it) {
+			if (it->second.empty()) { continue; }
+			hits++;
+			cl::Buffer buffer = it->second.back();
+			it->second.pop_back();
+			free_bytes -= get<3>(it->first);
+			Use(get<3>(it->first));
+			return buffer;
+		}
+		cl::Buffer buffer(context, flags, size);
+		owned[buffer()] = { buffer, key };
+		held += size;
+		Use(size);
+		return buffer;
+	}
+
+	//Gives a buffer back for reuse and empties the handle, nothing enqueued may still use it. Buffers the pool did not hand out are only let go.
+	void Release(cl::Buffer& buffer) {
+		if (buffer() == NULL) { return; }
+		lock_guard<mutex> lock(guard);
+		auto found = owned.find(buffer());
+		if (found != owned.end()) {
+			size_t size = get<3>(found->second.key);
+			in_use -= size;
+			free_buffers[found->second.key].push_back(buffer);
+			free_bytes += size;
+			TrimLocked(free_limit);
+		}
+		buffer = cl::Buffer();
+	}
+
+	//Lets go of free buffers, largest first, until at most limit bytes are free
+	void Trim(size_t limit = 0) {
+		lock_guard<mutex> lock(guard);
+		TrimLocked(limit);
+	}
+
+	//The size class of bytes, at least 64 bytes
+	static size_t SizeClass(size_t bytes) {
+		size_t size = 64;
+		while (size < bytes) { size <<= 1; }
+		return size;
+	}
+
+	size_t Requests() const { return requests; }
+	size_t Hits() const { return hits; }
+	size_t PeakBytes() const { return peak; } //the most bytes in use at once
+	size_t HeldBytes() const { return held; } //in use and free
+
+	//e.g. "buffer pool: 46/52 hits (88.5%), peak 24.3 MB in use, 32.1 MB held"
+	string Describe() const {
+		stringstream text;
+		text.precision(3);
+		text << "buffer pool: " << hits << "/" << requests << " hits (" << (requests ? 100.0 * hits / requests : 0) << "%), peak " << peak / 1048576.0 << " MB in use, " << held / 1048576.0 << " MB held";
+		return text.str();
+	}
+
+private:
+	typedef tuple<cl_context, cl_device_id, cl_mem_flags, size_t> Key;
+
+	struct Owned {
+		cl::Buffer buffer;
+		Key key;
+	};
+
+	static bool SameKind(const Key& a, const Key& b) {
+		return get<0>(a) == get<0>(b) && get<1>(a) == get<1>(b) && get<2>(a) == get<2>(b);
+	}
+
+	void Use(size_t size) {
+		in_use += size;
+		peak = max(peak, in_use);
+	}
+
+	void TrimLocked(size_t limit) {
+		while (free_bytes > limit) {
+			auto largest = free_buffers.end();
+			for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it) {
+				if (!it->second.empty() && (largest == free_buffers.end() || get<3>(it->first) > get<3>(largest->first))) { largest = it; }
+			}
+			size_t size = get<3>(largest->first);
+			owned.erase(largest->second.back()());
+			largest->second.pop_back();
+			free_bytes -= size;
+			held -= size;
+		}
+	}
+
+	mutex guard;
+	size_t free_limit;
+	map<Key, vector<cl::Buffer>> free_buffers;
+	map<cl_mem, Owned> owned; //every buffer the pool holds, in use or free, so a handle is only taken back if the pool handed it out
+	size_t requests = 0;
+	size_t hits = 0;
+	size_t in_use = 0;
+	size_t peak = 0;
+	size_t free_bytes = 0;
+	size_t held = 0;
+};
+
+} //namespace histeq
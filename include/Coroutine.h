@@ -0,0 +1,234 @@
+#pragma once
+
+//C++20 coroutine interface over OpenCL events, for servers that await many images from a few threads instead of blocking a thread
+//on each one. Compiled only with coroutine support (C++20), the header is empty otherwise.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+#include "HistogramEqualizer.h"
+
+namespace histeq {
+
+using namespace std;
+
+//Coroutines ready to continue, resumed by whichever threads call Run. Events complete on the OpenCL runtime's callback thread,
+//which must not be kept busy (nor make blocking OpenCL calls), so awaiters post to a scheduler rather than resume there.
+class CoroutineScheduler {
+public:
+	void Post(coroutine_handle<> handle) {
+		lock_guard<mutex> lock(m);
+		ready.push_back(handle);
+		notEmpty.notify_one();
+	}
+
+	//Resumes posted coroutines on the calling thread until Stop, from any number of threads
+	void Run() {
+		coroutine_handle<> handle;
+		while (Next(handle, true)) { handle.resume(); }
+	}
+
+	//Resumes the coroutines posted so far without waiting for more, returns how many
+	int Poll() {
+		int count = 0;
+		coroutine_handle<> handle;
+		while (Next(handle, false)) {
+			handle.resume();
+			count++;
+		}
+		return count;
+	}
+
+	//Run returns once the coroutines already posted have been resumed
+	void Stop() {
+		lock_guard<mutex> lock(m);
+		stopped = true;
+		notEmpty.notify_all();
+	}
+
+	//co_await scheduler.Schedule() continues the coroutine on one of the threads running the scheduler
+	auto Schedule() {
+		struct ScheduleAwaiter {
+			CoroutineScheduler* scheduler;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(coroutine_handle<> handle) { scheduler->Post(handle); }
+			void await_resume() const noexcept {}
+		};
+		return ScheduleAwaiter{ this };
+	}
+
+private:
+	bool Next(coroutine_handle<>& handle, bool wait) {
+		unique_lock<mutex> lock(m);
+		if (wait) { notEmpty.wait(lock, [&] { return !ready.empty() || stopped; }); }
+		if (ready.empty()) { return false; }
+		handle = ready.front();
+		ready.pop_front();
+		return true;
+	}
+
+	mutex m;
+	condition_variable notEmpty;
+	deque<coroutine_handle<>> ready;
+	bool stopped = false;
+};
+
+//co_await EventAwaiter{ event, &scheduler } suspends until the event's command has completed, without a thread waiting on it.
+//The coroutine continues on a scheduler thread, or on the runtime's callback thread when no scheduler is given (only for short work
+//that makes no blocking OpenCL calls). Throws cl::Error when the command failed.
+struct EventAwaiter {
+	cl::Event event;
+	CoroutineScheduler* scheduler;
+	coroutine_handle<> handle;
+
+	explicit EventAwaiter(const cl::Event& event, CoroutineScheduler* scheduler = nullptr) : event(event), scheduler(scheduler), handle(nullptr) {}
+
+	bool await_ready() const {
+		return !event() || event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() <= CL_COMPLETE;
+	}
+
+	void await_suspend(coroutine_handle<> suspended) {
+		//The awaiter lives in the suspended coroutine's frame, so it outlives the callback
+		handle = suspended;
+		event.setCallback(CL_COMPLETE, &EventAwaiter::Completed, this);
+	}
+
+	void await_resume() const {
+		if (!event()) { return; }
+		cl_int status = event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+		if (status < 0) { throw cl::Error(status, "EventAwaiter"); }
+	}
+
+	//Called on completion and on failure (a negative status)
+	static void CL_CALLBACK Completed(cl_event, cl_int, void* data) {
+		EventAwaiter* awaiter = (EventAwaiter*)data;
+		if (awaiter->scheduler) { awaiter->scheduler->Post(awaiter->handle); }
+		else { awaiter->handle.resume(); }
+	}
+};
+
+template <typename T>
+class Task;
+
+//The result half of a Task's promise
+template <typename T>
+struct TaskResult {
+	optional<T> value;
+	void return_value(T result) { value = std::move(result); }
+	T Take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+	void return_void() {}
+	void Take() {}
+};
+
+//A lazily started coroutine producing a T (or an exception), run by co_await-ing it. The awaiting coroutine continues when the task
+//finishes, on the thread that finished it. Use Spawn to start a task from outside a coroutine.
+template <typename T = void>
+class Task {
+public:
+	struct promise_type : TaskResult<T> {
+		exception_ptr error;
+		coroutine_handle<> continuation;
+
+		Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+		suspend_always initial_suspend() noexcept { return {}; }
+
+		struct FinalAwaiter {
+			bool await_ready() const noexcept { return false; }
+			coroutine_handle<> await_suspend(coroutine_handle<promise_type> finished) noexcept {
+				coroutine_handle<> next = finished.promise().continuation;
+				return next ? next : noop_coroutine();
+			}
+			void await_resume() const noexcept {}
+		};
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() { error = current_exception(); }
+	};
+
+	Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			if (handle) { handle.destroy(); }
+			handle = other.handle;
+			other.handle = nullptr;
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		if (handle) { handle.destroy(); }
+	}
+
+	bool await_ready() const noexcept { return !handle || handle.done(); }
+
+	coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		if (handle.promise().error) { rethrow_exception(handle.promise().error); }
+		return handle.promise().Take();
+	}
+
+private:
+	explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	coroutine_handle<promise_type> handle;
+};
+
+//A coroutine that starts at once and frees itself when done, for Spawn
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+//Starts a task on the calling thread and returns at its first suspension, failed gets what it throws
+inline DetachedTask Spawn(Task<void> task, function<void(exception_ptr)> failed = nullptr) {
+	try {
+		co_await task;
+	}
+	catch (...) {
+		if (failed) { failed(current_exception()); }
+	}
+}
+
+//The coroutine form of HistogramEqualizer::EqualizeAsync: equalizes width x height x depth x spectrum pixels from input into output
+//(see HistogramEqualizer::Equalize) and completes when output holds the result, continuing on a scheduler thread.
+//While both device slots are busy the coroutine waits for one to free up instead of a thread, so any number of images can be in flight
+//from a few threads, the device working on two at a time. Images for the CPU engine are equalized on the thread running the coroutine.
+//input and output must stay alive until the task completes.
+inline Task<void> EqualizeCoroutine(HistogramEqualizer& equalizer, CoroutineScheduler& scheduler, const unsigned char* input, unsigned char* output, int width, int height, int depth = 1, int spectrum = 1) {
+	if (!equalizer.PrefersDevice((size_t)width * height * depth * spectrum)) {
+		//CImg has no const views, the input is only read
+		CImg<unsigned char> image((unsigned char*)input, width, height, depth, spectrum, true);
+		CImg<unsigned char> equalized = equalizer.EqualizeOnCpu(image);
+		memcpy(output, equalized.data(), equalized.size());
+		co_return;
+	}
+
+	cl::Event done;
+	while (!equalizer.TryEnqueue(input, output, width, height, depth, spectrum, done)) {
+		co_await EventAwaiter{ done, &scheduler };
+	}
+	co_await EventAwaiter{ done, &scheduler };
+}
+
+} //namespace histeq
+
+#endif
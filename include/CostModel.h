@@ -0,0 +1,145 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+
+namespace histeq {
+
+//Estimated cost of equalizing an image on the OpenCL device and on the CPU engine.
+//Small images are faster on the host because of the fixed launch and transfer overhead, large ones on the device.
+struct CostModel {
+	double device_fixed_us = 0;			//per image cost of the device that does not depend on size, every command the mode enqueues
+	double transfer_bytes_per_us = 0;	//host <-> device bandwidth
+	double device_bytes_per_us = 0;		//throughput of the kernels themselves
+	double cpu_fixed_us = 0;			//per image cost of the CPU engine that does not depend on size
+	double cpu_bytes_per_us = 0;		//throughput of the CPU engine
+
+	double DeviceTime(size_t bytes) const { return device_fixed_us + 2 * bytes / transfer_bytes_per_us + bytes / device_bytes_per_us; }
+	double CpuTime(size_t bytes) const { return cpu_fixed_us + bytes / cpu_bytes_per_us; }
+	bool PreferDevice(size_t bytes) const { return DeviceTime(bytes) < CpuTime(bytes); }
+
+	string Describe(size_t bytes) const {
+		stringstream sstream;
+		sstream << (PreferDevice(bytes) ? "device" : "cpu") << " (estimated device " << DeviceTime(bytes) << " [us], cpu " << CpuTime(bytes) << " [us])";
+		return sstream.str();
+	}
+};
+
+//Wall time of fn in microseconds
+template <typename F>
+double TimeUs(F fn) {
+	auto start = std::chrono::steady_clock::now();
+	fn();
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Measures the cost model with synthetic images, takes a fraction of a second
+inline CostModel MeasureCostModel(DeviceState& state, CpuEngine& cpu, const EqualizeOptions& options) {
+	CostModel model;
+	const int repeats = 5;
+	const size_t large_bytes = 1 << 22;
+
+	CImg<unsigned char> small_image(64, 64, 1, 1);
+	CImg<unsigned char> large_image(1 << 11, large_bytes >> 11, 1, 1);
+	small_image.rand(0, 255);
+	large_image.rand(0, 255);
+
+	//Transfer bandwidth, a blocking write and read of the large image
+	cl::Buffer transfer(state.context, CL_MEM_READ_WRITE, large_bytes);
+	double transfer_us = TimeUs([&] {
+		for (int i = 0; i < repeats; i++) {
+			state.queue.enqueueWriteBuffer(transfer, CL_TRUE, 0, large_bytes, large_image.data());
+			state.queue.enqueueReadBuffer(transfer, CL_TRUE, 0, large_bytes, large_image.data());
+		}
+	}) / repeats;
+	model.transfer_bytes_per_us = 2 * large_bytes / max(transfer_us, 1.0);
+
+	//The mode's whole pipeline on both images, so the fixed cost covers however many commands it enqueues. Kernel throughput from the
+	//difference beyond the transfers, fixed cost from the small image.
+	ImageBuffers buffers;
+	cl::Event done;
+	EqualizeImage(state, buffers, small_image, options, done);
+	double device_small_us = TimeUs([&] { for (int i = 0; i < repeats; i++) { EqualizeImage(state, buffers, small_image, options, done); } }) / repeats;
+	EqualizeImage(state, buffers, large_image, options, done);
+	double device_large_us = TimeUs([&] { for (int i = 0; i < repeats; i++) { EqualizeImage(state, buffers, large_image, options, done); } }) / repeats;
+	double kernel_us = device_large_us - device_small_us - 2 * (large_bytes - small_image.size()) / model.transfer_bytes_per_us;
+	model.device_bytes_per_us = (large_bytes - small_image.size()) / max(kernel_us, 1.0);
+	model.device_fixed_us = max(device_small_us - 2 * small_image.size() / model.transfer_bytes_per_us - small_image.size() / model.device_bytes_per_us, 0.0);
+
+	//CPU engine, fixed cost from the small image and throughput from the difference to the large one
+	cpu.Equalize(small_image, options);
+	double cpu_small_us = TimeUs([&] { for (int i = 0; i < repeats; i++) { cpu.Equalize(small_image, options); } }) / repeats;
+	double cpu_large_us = TimeUs([&] { for (int i = 0; i < repeats; i++) { cpu.Equalize(large_image, options); } }) / repeats;
+	model.cpu_bytes_per_us = (large_bytes - small_image.size()) / max(cpu_large_us - cpu_small_us, 1.0);
+	model.cpu_fixed_us = max(cpu_small_us - small_image.size() / model.cpu_bytes_per_us, 0.0);
+
+	return model;
+}
+
+//Cost models are cached in a text file, one line per device, CPU thread count, bin size, mode and scan kernel:
+//key|device_fixed_us transfer_bytes_per_us device_bytes_per_us cpu_fixed_us cpu_bytes_per_us
+inline string CostModelKey(const DeviceState& state, const CpuEngine& cpu, const EqualizeOptions& options) {
+	stringstream sstream;
+	sstream << state.device.getInfo<CL_DEVICE_NAME>() << ";" << state.device.getInfo<CL_DRIVER_VERSION>() << ";" << cpu.Threads() << " threads;" << options.bin_size << " bins;"
+		<< options.mode << ";" << options.scanKernel;
+	return sstream.str();
+}
+
+inline bool LoadCostModel(const string& cache_file, const string& key, CostModel& model) {
+	ifstream file(cache_file);
+	string line;
+	while (getline(file, line)) {
+		size_t split = line.rfind('|');
+		if (split == string::npos || line.substr(0, split) != key) { continue; }
+		stringstream values(line.substr(split + 1));
+		if (values >> model.device_fixed_us >> model.transfer_bytes_per_us >> model.device_bytes_per_us >> model.cpu_fixed_us >> model.cpu_bytes_per_us) { return true; }
+	}
+	return false;
+}
+
+//Rewrites the cache with the entry for key replaced, the other entries kept once each
+inline void SaveCostModel(const string& cache_file, const string& key, const CostModel& model) {
+	vector<string> lines;
+	{
+		ifstream file(cache_file);
+		string line;
+		while (getline(file, line)) {
+			size_t split = line.rfind('|');
+			if (split == string::npos || line.substr(0, split) == key) { continue; }
+			bool seen = false;
+			for (const string& kept : lines) { seen = seen || kept.compare(0, split + 1, line, 0, split + 1) == 0; }
+			if (!seen) { lines.push_back(line); }
+		}
+	}
+	stringstream entry;
+	entry << key << "|" << model.device_fixed_us << " " << model.transfer_bytes_per_us << " " << model.device_bytes_per_us << " " << model.cpu_fixed_us << " " << model.cpu_bytes_per_us;
+	lines.push_back(entry.str());
+
+	ofstream file(cache_file, ios::trunc);
+	for (const string& line : lines) { file << line << endl; }
+}
+
+//Loads the cost model for this device from the cache, measuring and caching it the first time
+inline CostModel GetCostModel(DeviceState& state, CpuEngine& cpu, const EqualizeOptions& options, const string& cache_file, bool verbose) {
+	CostModel model;
+	string key = CostModelKey(state, cpu, options);
+	if (LoadCostModel(cache_file, key, model)) {
+		if (verbose) { std::cout << "Loaded cost model from " << cache_file << std::endl; }
+	}
+	else {
+		model = MeasureCostModel(state, cpu, options);
+		SaveCostModel(cache_file, key, model);
+	}
+	if (verbose) {
+		std::cout << "Cost model: device " << model.device_fixed_us << " [us] per image, transfer " << model.transfer_bytes_per_us << " [B/us], kernels "
+			<< model.device_bytes_per_us << " [B/us], cpu " << model.cpu_fixed_us << " [us] + " << model.cpu_bytes_per_us << " [B/us]" << std::endl;
+	}
+	return model;
+}
+
+} //namespace histeq
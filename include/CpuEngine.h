@@ -0,0 +1,626 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//The AVX2 LUT map is compiled for AVX2 on its own and picked at run time, the rest keeps the build's baseline instruction set
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define HISTEQ_AVX2
+#define HISTEQ_TARGET_AVX2
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HISTEQ_AVX2
+#define HISTEQ_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "Equalizer.h"
+
+namespace histeq {
+
+//Persistent pool of worker threads, the thread calling ParallelFor works alongside the pool.
+//Jobs from several threads run one after another, a job must not start another from inside fn.
+class ThreadPool {
+public:
+	explicit ThreadPool(int threads) {
+		for (int t = 1; t < threads; t++) {
+			workers.emplace_back([this] { Work(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			lock_guard<mutex> lock(m);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (thread& worker : workers) { worker.join(); }
+	}
+
+	int Size() const { return (int)workers.size() + 1; }
+
+	//Runs fn(task) for every task in [0, tasks) and returns once all of them are done
+	void ParallelFor(int tasks, const function<void(int)>& fn) {
+		lock_guard<mutex> one_job(serial);
+		{
+			lock_guard<mutex> lock(m);
+			job = &fn;
+			job_tasks = tasks;
+			next_task = 0;
+			active = (int)workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		RunTasks();
+
+		//Every worker has to leave RunTasks before the next job may reuse the counters
+		unique_lock<mutex> lock(m);
+		finished.wait(lock, [&] { return active == 0; });
+		job = nullptr;
+	}
+
+private:
+	void RunTasks() {
+		for (int task = next_task++; task < job_tasks; task = next_task++) {
+			(*job)(task);
+		}
+	}
+
+	void Work() {
+		size_t seen = 0;
+		while (true) {
+			{
+				unique_lock<mutex> lock(m);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping) { return; }
+				seen = generation;
+			}
+			RunTasks();
+			lock_guard<mutex> lock(m);
+			if (--active == 0) { finished.notify_all(); }
+		}
+	}
+
+	vector<thread> workers;
+	mutex serial; //held for a whole job, the counters below are the one job's
+	mutex m;
+	condition_variable wake;
+	condition_variable finished;
+	bool stopping = false;
+	size_t generation = 0;
+	int active = 0;
+	const function<void(int)>* job = nullptr;
+	int job_tasks = 0;
+	atomic<int> next_task{ 0 };
+};
+
+#ifdef HISTEQ_AVX2
+//Whether the CPU and the OS (the saved AVX state) support AVX2
+inline bool HasAvx2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) { return false; }
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) { return false; }
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+//Gather-free lookup of the whole 32 pixel blocks, returns how many pixels were mapped: the LUT is split into 16 tables of 16 entries
+//which vpshufb indexes with the low nibble, the high nibble of each pixel picks which table's result is kept
+HISTEQ_TARGET_AVX2 inline size_t MapPixelsAvx2(const unsigned char* in, unsigned char* out, size_t n, const unsigned char* lut) {
+	__m256i tables[16];
+	for (int k = 0; k < 16; k++) {
+		tables[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * k)));
+	}
+	const __m256i low_mask = _mm256_set1_epi8(0x0F);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+		__m256i lo = _mm256_and_si256(x, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+		__m256i result = _mm256_setzero_si256();
+		for (int k = 0; k < 16; k++) {
+			__m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k));
+			result = _mm256_or_si256(result, _mm256_and_si256(select, _mm256_shuffle_epi8(tables[k], lo)));
+		}
+		_mm256_storeu_si256((__m256i*)(out + i), result);
+	}
+	return i;
+}
+#endif
+
+//Maps every pixel through a 256 entry LUT, with AVX2 when the CPU has it
+inline void MapPixels(const unsigned char* in, unsigned char* out, size_t n, const unsigned char* lut) {
+	size_t i = 0;
+#ifdef HISTEQ_AVX2
+	static const bool avx2 = HasAvx2();
+	if (avx2) { i = MapPixelsAvx2(in, out, n, lut); }
+#endif
+	for (; i < n; i++) {
+		out[i] = lut[in[i]];
+	}
+}
+
+//Counts the pixels where an output differs from the reference
+inline size_t CompareImages(const CImg<unsigned char>& output, const CImg<unsigned char>& reference, int& max_difference) {
+	size_t mismatches = 0;
+	max_difference = 0;
+	for (size_t i = 0; i < output.size() && i < reference.size(); i++) {
+		int difference = abs((int)output[i] - (int)reference[i]);
+		if (difference) {
+			mismatches++;
+			max_difference = max(max_difference, difference);
+		}
+	}
+	return mismatches;
+}
+
+//Native implementation of histogram -> scan -> normalize -> map, used when there is no OpenCL device and as the
+//reference the OpenCL results are checked against. The bin and LUT arithmetic matches my_kernels.cl exactly.
+//Safe to share between threads: the only state is the pool, whose jobs are serialized.
+class CpuEngine {
+public:
+	explicit CpuEngine(int threads) : pool(max(1, threads)) {}
+
+	int Threads() const { return pool.Size(); }
+
+	CImg<unsigned char> Equalize(const CImg<unsigned char>& image_input, const EqualizeOptions& options, Histograms* histograms = nullptr) {
+		if (options.mode == "backproject") {
+			if (histograms) { ModelHistograms(*options.model_histogram, histograms); }
+			return BackProject(image_input, *options.model_histogram);
+		}
+		CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+
+		//The channel and slice modes run the whole pipeline once per colour plane or slice with its own maximum
+		bool perChannel = options.mode == "channel" || options.mode == "slice";
+		int channels = HistogramPlanes(image_input, options.mode);
+		size_t planeSize = image_input.size() / channels;
+		if (histograms) {
+			histograms->channels = channels;
+			histograms->frequency.clear();
+			histograms->cumulative.clear();
+			histograms->normalized.clear();
+		}
+
+		if (options.mode == "clahe") {
+			EqualizeClahe(image_input, output_image, options, histograms);
+			return output_image;
+		}
+		if (options.mode == "luma" && image_input.spectrum() == 3) {
+			EqualizeLuma(image_input, output_image, options.bin_size, histograms);
+			return output_image;
+		}
+		if (options.mode == "stretch") {
+			Stretch(image_input, output_image, options, histograms);
+			return output_image;
+		}
+
+		for (int c = 0; c < channels; c++) {
+			int maximum = perChannel ? PlaneMaximum(image_input, channels, c) : image_input.max();
+			EqualizePlane(image_input.data() + c * planeSize, output_image.data() + c * planeSize, planeSize, maximum, options.bin_size, histograms,
+				options.mode == "match" ? options.reference.get() : nullptr);
+		}
+		return output_image;
+	}
+
+	//Histogram of size pixels binned as histogramVals bins them
+	vector<unsigned int> Histogram(const unsigned char* pixels, size_t size, int maximum, int bin_size) {
+		//Pixel values are 8 bit so counting values and folding them into bins afterwards is cheaper than binning every pixel
+		int tasks = pool.Size();
+		vector<array<unsigned int, 256>> partial(tasks);
+		pool.ParallelFor(tasks, [&](int task) {
+			size_t begin = size * task / tasks;
+			size_t end = size * (task + 1) / tasks;
+			//Four private sets of counters, so runs of equal pixels do not stall on the previous increment's store
+			unsigned int counts[4][256] = {};
+			size_t i = begin;
+			for (; i + 4 <= end; i += 4) {
+				counts[0][pixels[i]]++;
+				counts[1][pixels[i + 1]]++;
+				counts[2][pixels[i + 2]]++;
+				counts[3][pixels[i + 3]]++;
+			}
+			for (; i < end; i++) { counts[0][pixels[i]]++; }
+			for (int v = 0; v < 256; v++) {
+				partial[task][v] = counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v];
+			}
+		});
+
+		vector<unsigned int> frequency(bin_size, 0);
+		for (int task = 0; task < tasks; task++) {
+			for (int v = 0; v <= maximum; v++) {
+				frequency[maximum > 0 ? (int)((v / (float)maximum) * (bin_size - 1)) : 0] += partial[task][v];
+			}
+		}
+		return frequency;
+	}
+
+	//Histogram of every region of interest over all channels, same binning as histogramRois. The regions must lie inside the image.
+	vector<unsigned int> RoiHistograms(const CImg<unsigned char>& image, const vector<Roi>& rois, int bin_size) {
+		int maximum = image.max();
+		vector<int> bin_of(256, 0);
+		for (int v = 0; v <= maximum; v++) {
+			bin_of[v] = maximum > 0 ? (int)((v / (float)maximum) * (bin_size - 1)) : 0;
+		}
+		vector<unsigned int> counts(rois.size() * bin_size, 0);
+		pool.ParallelFor((int)rois.size(), [&](int r) {
+			const Roi& roi = rois[r];
+			unsigned int* hist = &counts[(size_t)r * bin_size];
+			for (int c = 0; c < image.spectrum(); c++) {
+				for (int y = roi.y; y < roi.y + roi.height; y++) {
+					const unsigned char* row = image.data(0, y, 0, c);
+					for (int x = roi.x; x < roi.x + roi.width; x++) { hist[bin_of[row[x]]]++; }
+				}
+			}
+		});
+		return counts;
+	}
+
+	//Bin of a pixel in a model histogram, same as backProject. Single channel pixels are passed with r, g and b equal,
+	//which has no hue or saturation. Hue (0-359) and saturation (0-255) are integer HSV so every engine gets the same bins.
+	static int BackProjectionBin(int r, int g, int b, bool rgb, int bin_size, bool hue_saturation) {
+		if (!hue_saturation) { return (int)(((rgb ? Luma(r, g, b) : r) / 255.0f) * (bin_size - 1)); }
+		return (Hue(r, g, b) * bin_size / 360) * bin_size + Saturation(r, g, b) * bin_size / 256;
+	}
+
+	//Same integer HSV as hue / saturation in my_kernels.cl
+	static int Hue(int r, int g, int b) {
+		int hi = max(r, max(g, b));
+		int d = hi - min(r, min(g, b));
+		if (d == 0) { return 0; }
+		if (hi == r) {
+			int h = (60 * (g - b)) / d;
+			return h < 0 ? h + 360 : h;
+		}
+		if (hi == g) { return 120 + (60 * (b - r)) / d; }
+		return 240 + (60 * (r - g)) / d;
+	}
+
+	static int Saturation(int r, int g, int b) {
+		int hi = max(r, max(g, b));
+		return hi > 0 ? (255 * (hi - min(r, min(g, b)))) / hi : 0;
+	}
+
+	//Joint histograms of plane a against plane b moved by every shift, binned as histogramJoint. With hue_saturation a is an RGB
+	//image paired with itself as hue x saturation and b is not used.
+	vector<unsigned int> JointCounts(const CImg<unsigned char>& a, const CImg<unsigned char>& b, const vector<Shift>& shifts, int binsA, int binsB, bool hue_saturation) {
+		int width = a.width();
+		int height = a.height();
+		int maxA = a.get_shared_channel(0).max();
+		int maxB = hue_saturation ? 0 : b.get_shared_channel(0).max();
+		size_t planeSize = (size_t)width * height;
+		size_t jointBins = (size_t)binsA * binsB;
+		vector<unsigned int> counts(shifts.size() * jointBins, 0);
+		pool.ParallelFor((int)shifts.size(), [&](int c) {
+			unsigned int* joint = &counts[c * jointBins];
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					size_t id = (size_t)y * width + x;
+					if (hue_saturation) {
+						int r = a[id], g = a[planeSize + id], bl = a[2 * planeSize + id];
+						joint[(Hue(r, g, bl) * binsA / 360) * binsB + Saturation(r, g, bl) * binsB / 256]++;
+						continue;
+					}
+					int xb = x + shifts[c].dx;
+					int yb = y + shifts[c].dy;
+					if (xb < 0 || yb < 0 || xb >= b.width() || yb >= b.height()) { continue; }
+					int binA = maxA > 0 ? (int)((a[id] / (float)maxA) * (binsA - 1)) : 0;
+					int binB = maxB > 0 ? (int)((b(xb, yb) / (float)maxB) * (binsB - 1)) : 0;
+					joint[binA * binsB + binB]++;
+				}
+			}
+		});
+		return counts;
+	}
+
+	//Mutual information in bits of a joint histogram, as mutualInformation but summed in double precision
+	static double MutualInformation(const unsigned int* joint, int binsA, int binsB) {
+		vector<unsigned long long> rows(binsA, 0), columns(binsB, 0);
+		unsigned long long total = 0;
+		for (int a = 0; a < binsA; a++) {
+			for (int b = 0; b < binsB; b++) {
+				rows[a] += joint[a * binsB + b];
+				columns[b] += joint[a * binsB + b];
+				total += joint[a * binsB + b];
+			}
+		}
+		double sum = 0;
+		for (int a = 0; a < binsA; a++) {
+			for (int b = 0; b < binsB; b++) {
+				double n = joint[a * binsB + b];
+				if (n > 0) { sum += n * log2(n * total / ((double)rows[a] * columns[b])); }
+			}
+		}
+		return total > 0 ? sum / total : 0;
+	}
+
+	//Likelihood of every pixel's bin in the model, a single channel image as from backProject
+	CImg<unsigned char> BackProject(const CImg<unsigned char>& image_input, const ModelHistogram& model) {
+		bool rgb = image_input.spectrum() >= 3;
+		size_t planeSize = image_input.size() / image_input.spectrum();
+		const unsigned char* r = image_input.data();
+		const unsigned char* g = rgb ? r + planeSize : r;
+		const unsigned char* b = rgb ? r + 2 * planeSize : r;
+		CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), 1);
+		unsigned char* out = output_image.data();
+
+		const size_t chunk = 1 << 16;
+		int chunks = (int)((planeSize + chunk - 1) / chunk);
+		pool.ParallelFor(chunks, [&](int c) {
+			size_t end = min(planeSize, (c + 1) * chunk);
+			for (size_t i = c * chunk; i < end; i++) {
+				out[i] = model.likelihood[BackProjectionBin(r[i], g[i], b[i], rgb, model.bin_size, model.hue_saturation)];
+			}
+		});
+		return output_image;
+	}
+
+	//Maps size pixels through a 256 entry LUT on every thread
+	void Map(const unsigned char* pixels, unsigned char* out, size_t size, const unsigned char* lut) {
+		const size_t chunk = 1 << 16;
+		int chunks = (int)((size + chunk - 1) / chunk);
+		pool.ParallelFor(chunks, [&](int c) {
+			size_t begin = c * chunk;
+			MapPixels(pixels + begin, out + begin, min(chunk, size - begin), lut);
+		});
+	}
+
+private:
+	//Equalizes size pixels from pixels into out, appending the intermediate results to histograms
+	void EqualizePlane(const unsigned char* pixels, unsigned char* out, size_t size, int maximum, int bin_size, Histograms* histograms, const ReferenceHistogram* reference = nullptr) {
+		unsigned char lut[256];
+		BuildLut(pixels, size, maximum, bin_size, histograms, lut, reference);
+		Map(pixels, out, size, lut);
+	}
+
+	//Same clip points and linear map as stretchLut / mapStretch
+	void Stretch(const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const EqualizeOptions& options, Histograms* histograms) {
+		int bin_size = options.bin_size;
+		int maximum = image_input.max();
+		vector<unsigned int> frequency = Histogram(image_input.data(), image_input.size(), maximum, bin_size);
+		vector<unsigned int> cumulative(bin_size);
+		unsigned int running = 0;
+		for (int i = 0; i < bin_size; i++) {
+			running += frequency[i];
+			cumulative[i] = running;
+		}
+
+		unsigned long long total = running;
+		int lowBin = bin_size - 1;
+		int highBin = bin_size - 1;
+		for (int i = bin_size - 1; i >= 0; i--) {
+			if ((unsigned long long)cumulative[i] * 10000 >= total * options.stretch_low) { lowBin = i; }
+			if ((unsigned long long)cumulative[i] * 10000 >= total * options.stretch_high) { highBin = i; }
+		}
+		int low = -1;
+		int high = 0;
+		vector<int> first(bin_size, -1);
+		for (int v = 0; v <= maximum; v++) {
+			int bin = maximum > 0 ? (int)((v / (float)maximum) * (bin_size - 1)) : 0;
+			if (low < 0 && bin >= lowBin) { low = v; }
+			if (bin <= highBin) { high = v; }
+			if (first[bin] < 0) { first[bin] = v; }
+		}
+		if (high <= low) {
+			low = 0;
+			high = 255;
+		}
+
+		unsigned char lut[256];
+		for (int v = 0; v < 256; v++) { lut[v] = (unsigned char)min(max((v - low) * 255 / (high - low), 0), 255); }
+		Map(image_input.data(), output_image.data(), image_input.size(), lut);
+
+		if (histograms) {
+			histograms->frequency = frequency;
+			histograms->cumulative = cumulative;
+			histograms->normalized.resize(bin_size);
+			for (int i = 0; i < bin_size; i++) { histograms->normalized[i] = first[i] < 0 ? 0 : lut[first[i]]; }
+		}
+	}
+
+	//Same luma and conversion back to RGB as histogramLuma / mapLuma
+	static int Luma(int r, int g, int b) { return (77 * r + 150 * g + 29 * b + 128) >> 8; }
+
+	void EqualizeLuma(const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, int bin_size, Histograms* histograms) {
+		size_t planeSize = image_input.size() / 3;
+		const unsigned char* r = image_input.data();
+		const unsigned char* g = r + planeSize;
+		const unsigned char* b = g + planeSize;
+		unsigned char* out = output_image.data();
+
+		const size_t chunk = 1 << 16;
+		int chunks = (int)((planeSize + chunk - 1) / chunk);
+		vector<unsigned char> y(planeSize);
+		pool.ParallelFor(chunks, [&](int c) {
+			size_t end = min(planeSize, (c + 1) * chunk);
+			for (size_t i = c * chunk; i < end; i++) { y[i] = (unsigned char)Luma(r[i], g[i], b[i]); }
+		});
+
+		unsigned char lut[256];
+		BuildLut(y.data(), planeSize, image_input.max(), bin_size, histograms, lut);
+
+		pool.ParallelFor(chunks, [&](int c) {
+			size_t end = min(planeSize, (c + 1) * chunk);
+			for (size_t i = c * chunk; i < end; i++) {
+				int dy = lut[y[i]] - y[i];
+				out[i] = (unsigned char)min(max(r[i] + dy, 0), 255);
+				out[planeSize + i] = (unsigned char)min(max(g[i] + dy, 0), 255);
+				out[2 * planeSize + i] = (unsigned char)min(max(b[i] + dy, 0), 255);
+			}
+		});
+	}
+
+	//Same tiles, clipping, redistribution and bilinear blend as claheHistograms / claheLuts / claheMap, or the box tiles and trilinear blend
+	//of claheHistograms3D / claheMap3D for volumes. A 2D grid is one layer of tiles of depth 1, where the trilinear blend rounds as the bilinear one.
+	void EqualizeClahe(const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const EqualizeOptions& options, Histograms* histograms) {
+		TileGrid grid = ClaheTiles(image_input, options);
+		int bin_size = options.bin_size;
+		int tileW = options.tile_width;
+		int tileH = options.tile_height;
+		int tileD = grid.tileDepth;
+		int maximum = image_input.max();
+		int clipLimit256 = (int)(options.clip_limit * 256);
+		size_t planeSize = (size_t)grid.width * grid.height;
+		const unsigned char* in = image_input.data();
+		unsigned char* out = output_image.data();
+
+		vector<int> bin_of(256, 0);
+		for (int v = 0; v <= maximum; v++) {
+			bin_of[v] = maximum > 0 ? (int)((v / (float)maximum) * (bin_size - 1)) : 0;
+		}
+
+		vector<unsigned int> frequency((size_t)grid.tiles * bin_size, 0);
+		vector<unsigned int> cumulative(frequency.size());
+		vector<unsigned char> luts(frequency.size());
+		pool.ParallelFor(grid.tiles, [&](int tile) {
+			int tx = tile % grid.tilesX;
+			int ty = (tile / grid.tilesX) % grid.tilesY;
+			int tz = (tile / (grid.tilesX * grid.tilesY)) % grid.tilesZ;
+			int c = tile / (grid.tilesX * grid.tilesY * grid.tilesZ);
+			int x0 = tx * tileW;
+			int y0 = ty * tileH;
+			int z0 = tz * tileD;
+			int w = min(tileW, grid.width - x0);
+			int h = min(tileH, grid.height - y0);
+			int d = min(tileD, grid.depth - z0);
+			unsigned int* hist = &frequency[(size_t)tile * bin_size];
+			for (int z = z0; z < z0 + d; z++) {
+				for (int y = y0; y < y0 + h; y++) {
+					const unsigned char* row = in + ((size_t)c * grid.depth + z) * planeSize + (size_t)y * grid.width;
+					for (int x = x0; x < x0 + w; x++) { hist[bin_of[row[x]]]++; }
+				}
+			}
+
+			unsigned int total = (unsigned int)(w * h * d);
+			unsigned int clip = max((unsigned int)(((unsigned long long)clipLimit256 * total) / (256 * (unsigned long long)bin_size)), 1u);
+			unsigned int excess = 0;
+			for (int i = 0; i < bin_size; i++) {
+				if (hist[i] > clip) { excess += hist[i] - clip; hist[i] = clip; }
+			}
+			unsigned int batch = excess / bin_size;
+			unsigned int residual = excess % bin_size;
+			for (int i = 0; i < bin_size; i++) { hist[i] += batch; }
+			if (residual > 0) {
+				int step = max(bin_size / (int)residual, 1);
+				for (int i = 0; i < bin_size && residual > 0; i += step, residual--) { hist[i]++; }
+			}
+
+			unsigned int sum = 0;
+			for (int i = 0; i < bin_size; i++) {
+				sum += hist[i];
+				cumulative[(size_t)tile * bin_size + i] = sum;
+				luts[(size_t)tile * bin_size + i] = (unsigned char)(int)((sum / (float)total) * maximum);
+			}
+		});
+
+		//Trilinear blend of the eight nearest tile LUTs, in half pixels as in claheMap3D
+		long long spanX = 2 * tileW;
+		long long spanY = 2 * tileH;
+		long long spanZ = 2 * tileD;
+		long long span = spanX * spanY * spanZ;
+		size_t layer = (size_t)grid.tilesX * grid.tilesY * bin_size;
+		int rows = grid.height * grid.depth * image_input.spectrum();
+		pool.ParallelFor(rows, [&](int row) {
+			int y = row % grid.height;
+			int z = (row / grid.height) % grid.depth;
+			int c = row / (grid.height * grid.depth);
+			int fy = 2 * y + 1 - tileH;
+			int fz = 2 * z + 1 - tileD;
+			int ty0 = fy < 0 ? 0 : min(fy / (2 * tileH), grid.tilesY - 1);
+			int tz0 = fz < 0 ? 0 : min(fz / (2 * tileD), grid.tilesZ - 1);
+			int ty1 = min(ty0 + 1, grid.tilesY - 1);
+			int tz1 = min(tz0 + 1, grid.tilesZ - 1);
+			long long wy = min(max(fy - ty0 * 2 * tileH, 0), 2 * tileH);
+			long long wz = min(max(fz - tz0 * 2 * tileD, 0), 2 * tileD);
+			const unsigned char* lower = &luts[((size_t)c * grid.tilesZ + tz0) * layer];
+			const unsigned char* upper = &luts[((size_t)c * grid.tilesZ + tz1) * layer];
+			size_t offset = (size_t)row * grid.width;
+			for (int x = 0; x < grid.width; x++) {
+				int binNum = bin_of[in[offset + x]];
+				int fx = 2 * x + 1 - tileW;
+				int tx0 = fx < 0 ? 0 : min(fx / (2 * tileW), grid.tilesX - 1);
+				int tx1 = min(tx0 + 1, grid.tilesX - 1);
+				long long wx = min(max(fx - tx0 * 2 * tileW, 0), 2 * tileW);
+				size_t i00 = (ty0 * grid.tilesX + tx0) * bin_size + binNum;
+				size_t i10 = (ty0 * grid.tilesX + tx1) * bin_size + binNum;
+				size_t i01 = (ty1 * grid.tilesX + tx0) * bin_size + binNum;
+				size_t i11 = (ty1 * grid.tilesX + tx1) * bin_size + binNum;
+				long long lowerBlend = lower[i00] * (spanX - wx) * (spanY - wy) + lower[i10] * wx * (spanY - wy) + lower[i01] * (spanX - wx) * wy + lower[i11] * wx * wy;
+				long long upperBlend = upper[i00] * (spanX - wx) * (spanY - wy) + upper[i10] * wx * (spanY - wy) + upper[i01] * (spanX - wx) * wy + upper[i11] * wx * wy;
+				long long blended = lowerBlend * (spanZ - wz) + upperBlend * wz;
+				out[offset + x] = (unsigned char)((blended + span / 2) / span);
+			}
+		});
+
+		if (histograms) {
+			histograms->channels = grid.tiles;
+			histograms->frequency = frequency;
+			histograms->cumulative = cumulative;
+			histograms->normalized = luts;
+		}
+	}
+
+	//Histogram -> scan -> normalize of size pixels, folded into a LUT indexed by pixel value.
+	//With a reference the normalization is replaced by the inverse of the reference CDF.
+	void BuildLut(const unsigned char* pixels, size_t size, int maximum, int bin_size, Histograms* histograms, unsigned char* lut, const ReferenceHistogram* reference = nullptr) {
+		vector<unsigned int> frequency = Histogram(pixels, size, maximum, bin_size);
+
+		//Same bin calculation as histogramVals
+		vector<int> bin_of(256, 0);
+		for (int v = 0; v <= maximum; v++) {
+			bin_of[v] = maximum > 0 ? (int)((v / (float)maximum) * (bin_size - 1)) : 0;
+		}
+		//Inclusive scan
+		vector<unsigned int> cumulative(bin_size);
+		unsigned int total = 0;
+		for (int i = 0; i < bin_size; i++) {
+			total += frequency[i];
+			cumulative[i] = total;
+		}
+
+		//Same normalization as normHistogramVals
+		vector<unsigned char> normalized(bin_size);
+		for (int i = 0; i < bin_size; i++) {
+			normalized[i] = (unsigned char)(int)((cumulative[i] / (float)total) * maximum);
+		}
+
+		//Same search as matchHistogram
+		if (reference) {
+			int referenceBins = (int)reference->cdf.size();
+			unsigned long long referenceTotal = reference->cdf[referenceBins - 1];
+			for (int i = 0; i < bin_size; i++) {
+				auto reaches = [&](unsigned int r) { return (unsigned long long)r * total >= (unsigned long long)cumulative[i] * referenceTotal; };
+				int j = (int)(find_if(reference->cdf.begin(), reference->cdf.end(), reaches) - reference->cdf.begin());
+				j = min(j, referenceBins - 1);
+				normalized[i] = referenceBins > 1 ? (unsigned char)(int)((j / (float)(referenceBins - 1)) * reference->maximum) : (unsigned char)reference->maximum;
+			}
+		}
+
+		//Fold the bin lookup and the normalized histogram into one LUT indexed by pixel value
+		fill(lut, lut + 256, 0);
+		for (int v = 0; v <= maximum; v++) { lut[v] = normalized[bin_of[v]]; }
+
+		if (histograms) {
+			histograms->frequency.insert(histograms->frequency.end(), frequency.begin(), frequency.end());
+			histograms->cumulative.insert(histograms->cumulative.end(), cumulative.begin(), cumulative.end());
+			histograms->normalized.insert(histograms->normalized.end(), normalized.begin(), normalized.end());
+		}
+	}
+
+	ThreadPool pool;
+};
+
+} //namespace histeq
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+#include "Batch.h"
+
+namespace histeq {
+
+//Daemon mode: the context, program, kernels and buffers are set up once and every request on a Unix domain socket is pure compute.
+//POSIX only, the command line rejects -D on Windows. The socket is only open to the daemon's user (0600).
+//Requests and replies are single lines:
+//	equalize <input> <output> [bins=N] [scan=bl|hs|si] [mode=M] [tile=WxH[xD]] [clip=K] [stretch=low,high]
+//		-> OK <width>x<height>x<depth>x<channels> <time [us]>, or ERROR <message>
+//	ping -> OK
+//	quit -> OK, and the daemon stops
+//input and output are file paths, an output being relative to the daemon's output directory and kept inside it, or shared memory holding a SharedImageHeader and, shared_image_offset bytes in, the pixels in CImg's
+//planar layout: shm:/name for a POSIX shared memory object, fd:N for the Nth descriptor sent along with the request line (SCM_RIGHTS,
+//e.g. a memfd). The daemon sizes an output that is too small for the result (a shm:/ output is created when missing, the client
+//unlinks it once read), otherwise the client's region is written as it is.
+//With a device and shared memory on both sides the regions are wrapped as the image buffers (CL_MEM_USE_HOST_PTR), so the kernels
+//read the client's pixels and write the result in place and no pixel is copied on the host. The global, stretch and match modes pad
+//the input to a multiple of the bin size, so the input stays wrapped when it is writable and has room for bin size bytes after the pixels.
+//Options left out of a request keep the daemon's command line values. The match and backproject modes use the reference or model
+//loaded at startup, so they are only served with the daemon's own mode and bin size.
+
+const uint32_t shared_image_magic = 0x31514548; //"HEQ1"
+const size_t shared_image_offset = 4096; //page aligned pixels, as runtimes want for zero-copy host pointers
+
+struct SharedImageHeader {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t spectrum;
+};
+
+#ifndef _WIN32
+//Shared memory mapped for as long as the image is in use, pixels is a view of the mapping and room the bytes usable from it on
+struct SharedImage {
+	void* mapping = MAP_FAILED;
+	size_t bytes = 0;
+	size_t room = 0;
+	CImg<unsigned char> pixels;
+
+	SharedImage() = default;
+	SharedImage(const SharedImage&) = delete;
+	SharedImage& operator=(const SharedImage&) = delete;
+	~SharedImage() {
+		pixels.assign();
+		if (mapping != MAP_FAILED) { munmap(mapping, bytes); }
+	}
+};
+
+inline bool IsSharedSpec(const string& spec) {
+	return spec.compare(0, 4, "shm:") == 0 || spec.compare(0, 3, "fd:") == 0;
+}
+
+//Opens shm:/name or fd:N (a duplicate of the descriptor, so it can be closed like the others), -1 when it cannot.
+//A shared memory name is a single component, as POSIX defines it portably.
+inline int OpenSharedSpec(const string& spec, const vector<int>& fds, int flags) {
+	if (spec.compare(0, 3, "fd:") == 0) {
+		int index = atoi(spec.c_str() + 3);
+		return index >= 0 && index < (int)fds.size() ? dup(fds[index]) : -1;
+	}
+	string name = spec.substr(4);
+	if (name.size() < 2 || name.size() > NAME_MAX || name[0] != '/' || name.find('/', 1) != string::npos) { return -1; }
+	return shm_open(name.c_str(), flags, 0600);
+}
+
+//Maps an image a client wrote to shared memory, read-write when the client allows it so the padding can be written after the pixels
+inline void OpenSharedImage(const string& spec, const vector<int>& fds, SharedImage& image) {
+	int fd = OpenSharedSpec(spec, fds, O_RDWR);
+	bool writable = fd >= 0;
+	if (!writable) { fd = OpenSharedSpec(spec, fds, O_RDONLY); }
+	if (fd < 0) { throw CImgIOException("cannot open shared memory '%s'", spec.c_str()); }
+	struct stat info;
+	fstat(fd, &info);
+	image.bytes = (size_t)info.st_size;
+	if (image.bytes > shared_image_offset) {
+		image.mapping = mmap(NULL, image.bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (image.mapping == MAP_FAILED && writable) { image.mapping = mmap(NULL, image.bytes, PROT_READ, MAP_SHARED, fd, 0); writable = false; }
+	}
+	close(fd);
+	if (image.mapping == MAP_FAILED) { throw CImgIOException("cannot map shared memory '%s'", spec.c_str()); }
+
+	//The client can still write to the header, so it is read once. Every extent has to fit CImg's int and the pixels the mapping.
+	SharedImageHeader header = *(const SharedImageHeader*)image.mapping;
+	bool valid = header.magic == shared_image_magic;
+	size_t size = 1;
+	for (uint32_t extent : { header.width, header.height, header.depth, header.spectrum }) {
+		if (!valid || extent == 0 || extent > (uint32_t)INT_MAX || size > SIZE_MAX / extent) {
+			valid = false;
+			break;
+		}
+		size *= extent;
+	}
+	if (!valid || size > image.bytes - shared_image_offset) {
+		throw CImgIOException("shared memory '%s' does not hold an image", spec.c_str());
+	}
+	image.room = writable ? image.bytes - shared_image_offset : size;
+	//Only written past the pixels (the padding), CImg has no const views
+	unsigned char* pixels = (unsigned char*)image.mapping + shared_image_offset;
+	image.pixels.assign(pixels, (int)header.width, (int)header.height, (int)header.depth, (int)header.spectrum, true);
+}
+
+//Maps the shared memory a result is written to, grown to a width x height x depth x spectrum image and slack bytes after it when smaller
+inline void CreateSharedImage(const string& spec, const vector<int>& fds, int width, int height, int depth, int spectrum, size_t slack, SharedImage& image) {
+	size_t size = (size_t)width * height * depth * spectrum;
+	int fd = OpenSharedSpec(spec, fds, O_CREAT | O_RDWR);
+	if (fd < 0) { throw CImgIOException("cannot create shared memory '%s'", spec.c_str()); }
+	struct stat info;
+	fstat(fd, &info);
+	image.bytes = max((size_t)info.st_size, shared_image_offset + size + slack);
+	if ((size_t)info.st_size >= image.bytes || ftruncate(fd, (off_t)image.bytes) == 0) {
+		image.mapping = mmap(NULL, image.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (image.mapping == MAP_FAILED) { throw CImgIOException("cannot map shared memory '%s'", spec.c_str()); }
+
+	SharedImageHeader* header = (SharedImageHeader*)image.mapping;
+	*header = { shared_image_magic, (uint32_t)width, (uint32_t)height, (uint32_t)depth, (uint32_t)spectrum };
+	image.room = image.bytes - shared_image_offset;
+	image.pixels.assign((unsigned char*)image.mapping + shared_image_offset, width, height, depth, spectrum, true);
+}
+#endif
+
+//Applies a request's key=value options on top of the daemon's, returns an empty string or what is wrong with them
+inline string ApplyRequestOptions(const vector<string>& tokens, const EqualizeOptions& defaults, EqualizeOptions& options) {
+	options = defaults;
+	string scan = defaults.scanKernel == "scan_bl" ? "bl" : defaults.scanKernel == "simpleScan" ? "si" : "hs";
+	for (const string& token : tokens) {
+		size_t equals = token.find('=');
+		if (equals == string::npos) { return "unknown option " + token; }
+		string key = token.substr(0, equals);
+		string value = token.substr(equals + 1);
+		if (key == "bins") { options.bin_size = atoi(value.c_str()); }
+		else if (key == "scan") { scan = value; }
+		else if (key == "mode") { options.mode = value; }
+		else if (key == "tile") {
+			options.tile_depth = 0;
+			if (sscanf(value.c_str(), "%dx%dx%d", &options.tile_width, &options.tile_height, &options.tile_depth) < 2) { return "invalid tile size " + value; }
+		}
+		else if (key == "clip") { options.clip_limit = (float)atof(value.c_str()); }
+		else if (key == "stretch") {
+			float low = 0, high = 0;
+			if (sscanf(value.c_str(), "%f,%f", &low, &high) != 2 || low < 0 || high > 100 || low >= high) { return "invalid stretch percentiles " + value; }
+			options.stretch_low = (int)(low * 100 + 0.5f);
+			options.stretch_high = (int)(high * 100 + 0.5f);
+		}
+		else { return "unknown option " + key; }
+	}
+
+	if (options.bin_size < 1 || options.bin_size > 256) { return "bin size must be between 1 and 256"; }
+	if (scan != "bl" && scan != "hs" && scan != "si") { return "unknown scan " + scan; }
+	if (options.tile_width < 1 || options.tile_height < 1 || options.tile_depth < 0) { return "invalid tile size"; }
+	bool loadedMode = options.mode == "match" || options.mode == "backproject";
+	if (loadedMode && (options.mode != defaults.mode || options.bin_size != defaults.bin_size)) { return "the " + options.mode + " mode is only served with the daemon's own mode and bin size"; }
+	if (!loadedMode && options.mode != "global" && options.mode != "channel" && options.mode != "luma" && options.mode != "clahe" && options.mode != "stretch" && options.mode != "slice") {
+		return "unknown mode " + options.mode;
+	}
+	options.scanKernel = ScanKernelName(scan, options.bin_size);
+	return "";
+}
+
+//Where a request's file output goes: output relative to output_dir, false when it is absolute or leads out of output_dir
+inline bool DaemonOutputPath(const string& output_dir, const string& output, string& path) {
+	fs::path relative(output);
+	if (relative.empty() || relative.is_absolute() || relative.has_root_name() || relative.has_root_directory()) { return false; }
+	//Resolved as far as it exists, so neither .. nor a link inside output_dir leads out of it
+	std::error_code error;
+	fs::path root = fs::weakly_canonical(output_dir, error);
+	fs::path target = fs::weakly_canonical(fs::path(output_dir) / relative, error);
+	if (error) { return false; }
+	fs::path inside = target.lexically_relative(root);
+	if (inside.empty() || *inside.begin() == "..") { return false; }
+	path = target.string();
+	return true;
+}
+
+#ifndef _WIN32
+//Runs one equalize request, fds are the descriptors sent with it, file outputs are written under output_dir. Returns the reply line.
+inline string ServeEqualize(DeviceState* state, CpuEngine* cpu, ImageBuffers& buffers, const vector<string>& tokens, const vector<int>& fds, const string& output_dir, const EqualizeOptions& defaults) {
+	if (tokens.size() < 3) { return "ERROR usage: equalize <input> <output> [options]"; }
+	EqualizeOptions options;
+	string problem = ApplyRequestOptions(vector<string>(tokens.begin() + 3, tokens.end()), defaults, options);
+	if (!problem.empty()) { return "ERROR " + problem; }
+
+	const string& input = tokens[1];
+	string output = tokens[2];
+	if (!IsSharedSpec(output) && !DaemonOutputPath(output_dir, tokens[2], output)) { return "ERROR output " + tokens[2] + " is not inside the output directory"; }
+	auto start = std::chrono::steady_clock::now();
+
+	SharedImage shared_input;
+	CImg<unsigned char> image;
+	if (IsSharedSpec(input)) { OpenSharedImage(input, fds, shared_input); }
+	else { image = LoadImage8(input); }
+	const CImg<unsigned char>& image_input = IsSharedSpec(input) ? shared_input.pixels : image;
+
+	SharedImage shared_output;
+	CImg<unsigned char> result;
+	int channels = options.mode == "backproject" ? 1 : image_input.spectrum();
+	if (IsSharedSpec(output)) { CreateSharedImage(output, fds, image_input.width(), image_input.height(), image_input.depth(), channels, options.bin_size, shared_output); }
+	CImg<unsigned char>& output_image = IsSharedSpec(output) ? shared_output.pixels : result;
+
+	if (state) {
+		//Shared memory on both sides is used by the kernels as it is, otherwise a shared output is still the destination of the read
+		bool wrap = IsSharedSpec(input) && IsSharedSpec(output);
+		if (wrap) { buffers.Wrap(state->context, image_input.data(), shared_input.room, output_image.data(), shared_output.room); }
+		try {
+			cl::Event done;
+			EnqueueEqualize(*state, state->queue, buffers, image_input, output_image, options, done);
+			done.wait();
+		}
+		catch (...) {
+			state->queue.finish();
+			buffers.Unwrap();
+			throw;
+		}
+		buffers.Unwrap();
+	}
+	else if (IsSharedSpec(output)) {
+		CImg<unsigned char> equalized = cpu->Equalize(image_input, options);
+		memcpy(output_image.data(), equalized.data(), equalized.size());
+	}
+	else {
+		output_image = cpu->Equalize(image_input, options);
+	}
+	if (!IsSharedSpec(output)) { output_image.save(output.c_str()); }
+
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	stringstream reply;
+	reply << "OK " << output_image.width() << "x" << output_image.height() << "x" << output_image.depth() << "x" << output_image.spectrum() << " " << us;
+	return reply.str();
+}
+
+//Receives the next chunk of a connection, appending any descriptors sent with it to fds
+inline ssize_t ReceiveChunk(int connection, char* chunk, size_t size, vector<int>& fds) {
+	const int max_fds = 8;
+	char control[CMSG_SPACE(max_fds * sizeof(int))];
+	iovec data = { chunk, size };
+	msghdr message = {};
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); received > 0 && header; header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) { continue; }
+		int count = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		const int* received_fds = (const int*)CMSG_DATA(header);
+		fds.insert(fds.end(), received_fds, received_fds + count);
+	}
+	return received;
+}
+#endif
+
+//A client connection of the daemon, with its part of a request line and the descriptors sent with it
+struct DaemonConnection {
+	int socket = -1;
+	string pending;
+	vector<int> fds;
+};
+
+//Longest request line, a connection sending more without a newline is dropped
+const size_t max_request_line = 65536;
+
+//Serves requests on socket_path until a quit request. Any number of connections are polled and their requests served in turn on the
+//calling thread, as the engine runs one image at a time, so an idle client keeps no one else waiting. Each connection can send any
+//number of requests. File outputs are written under output_dir. Returns the number of images equalized.
+inline int RunDaemon(DeviceState* state, CpuEngine* cpu, const string& socket_path, const string& output_dir, const EqualizeOptions& defaults, bool verbose) {
+#ifdef _WIN32
+	throw CImgArgumentException("daemon mode needs Unix domain sockets and POSIX shared memory");
+#else
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path)) { throw CImgArgumentException("socket path '%s' is too long", socket_path.c_str()); }
+	strcpy(address.sun_path, socket_path.c_str());
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path.c_str()); //left behind by a daemon that was killed
+	//Only the daemon's user may connect, the socket file is created 0600
+	mode_t mask = umask(0177);
+	bool bound = listener >= 0 && ::bind(listener, (sockaddr*)&address, sizeof(address)) == 0;
+	umask(mask);
+	if (!bound || listen(listener, 8) != 0) {
+		if (listener >= 0) { close(listener); }
+		throw CImgIOException("cannot listen on '%s'", socket_path.c_str());
+	}
+
+	ImageBuffers buffers;
+	if (state) { buffers.pool = state->pool.get(); }
+	int served = 0;
+	bool running = true;
+	string failure;
+	vector<DaemonConnection> connections;
+	auto drop = [&](DaemonConnection& connection) {
+		for (int fd : connection.fds) { close(fd); }
+		close(connection.socket);
+		connection.socket = -1;
+	};
+
+	//Serves every complete line of a connection, false once the connection has to be dropped
+	auto serve_lines = [&](DaemonConnection& connection) {
+		size_t end;
+		while (running && (end = connection.pending.find('\n')) != string::npos) {
+			string line = connection.pending.substr(0, end);
+			connection.pending.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+
+			stringstream words(line);
+			vector<string> tokens;
+			string token;
+			while (words >> token) { tokens.push_back(token); }
+			if (tokens.empty()) { continue; }
+
+			string reply;
+			if (tokens[0] == "ping") { reply = "OK"; }
+			else if (tokens[0] == "quit") { reply = "OK"; running = false; }
+			else if (tokens[0] == "equalize") {
+				try {
+					reply = ServeEqualize(state, cpu, buffers, tokens, connection.fds, output_dir, defaults);
+					if (reply.compare(0, 2, "OK") == 0) { served++; }
+				}
+				catch (const cl::Error& err) {
+					reply = string("ERROR ") + err.what() + ", " + getErrorString(err.err());
+				}
+				catch (CImgException& err) {
+					reply = string("ERROR ") + err._message;
+				}
+			}
+			else { reply = "ERROR unknown request " + tokens[0]; }
+
+			//Descriptors belong to the request line they were sent with, they are closed once it has been served
+			for (int fd : connection.fds) { close(fd); }
+			connection.fds.clear();
+			if (verbose) { std::cerr << line << " -> " << reply << std::endl; }
+			reply += "\n";
+			//A client that does not read its replies is dropped rather than stalling the others
+			if (send(connection.socket, reply.data(), reply.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)reply.size()) { return false; }
+		}
+		return connection.pending.size() <= max_request_line;
+	};
+
+	while (running) {
+		vector<pollfd> polled(1, pollfd{ listener, POLLIN, 0 });
+		for (const DaemonConnection& connection : connections) { polled.push_back({ connection.socket, POLLIN, 0 }); }
+		if (poll(polled.data(), polled.size(), -1) < 0) {
+			if (errno == EINTR) { continue; }
+			failure = string("poll: ") + strerror(errno);
+			break;
+		}
+
+		for (size_t c = 0; c < connections.size() && running; c++) {
+			if (!polled[c + 1].revents) { continue; }
+			char chunk[4096];
+			ssize_t received = ReceiveChunk(connections[c].socket, chunk, sizeof(chunk), connections[c].fds);
+			if (received < 0 && errno == EINTR) { continue; }
+			if (received > 0) { connections[c].pending.append(chunk, received); }
+			if (received <= 0 || !serve_lines(connections[c])) { drop(connections[c]); }
+		}
+		connections.erase(remove_if(connections.begin(), connections.end(), [](const DaemonConnection& connection) { return connection.socket < 0; }), connections.end());
+
+		if (running && (polled[0].revents & POLLIN)) {
+			int client = accept(listener, NULL, NULL);
+			if (client >= 0) {
+				connections.emplace_back();
+				connections.back().socket = client;
+			}
+			else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				//Out of descriptors or memory, the pending connection waits while the served ones finish
+				if (verbose) { std::cerr << "accept: " << strerror(errno) << std::endl; }
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+			else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EPROTO) {
+				failure = string("accept: ") + strerror(errno);
+				break;
+			}
+		}
+	}
+	for (DaemonConnection& connection : connections) { drop(connection); }
+	close(listener);
+	unlink(socket_path.c_str());
+	if (!failure.empty()) { throw CImgIOException("daemon on '%s' stopped, %s", socket_path.c_str(), failure.c_str()); }
+	return served;
+#endif
+}
+
+} //namespace histeq
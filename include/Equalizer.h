@@ -0,0 +1,888 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "BufferPool.h"
+#include "CImg.h"
+
+namespace histeq {
+
+using namespace cimg_library;
+
+//Loads an image and converts it to 8 bit / using: https://github.com/dtschump/CImg/issues/218
+inline CImg<unsigned char> LoadImage8(const string& image_filename) {
+	CImg<unsigned short> img0(image_filename.c_str());
+	return (img0 / (img0.max() > 255 ? 257 : 1));
+}
+
+//Everything that only needs setting up once per run: the context, queue, built program and kernels
+struct DeviceState {
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue queue;
+	cl::Program program;
+	map<string, cl::Kernel> kernels;
+	shared_ptr<BufferPool> pool = make_shared<BufferPool>(); //shared by the buffers of every batch, stream and daemon run on this device
+	vector<cl::Device> sub_devices; //one per NUMA node when the device was split (context is then over all of them), otherwise empty
+
+	//Kernels are created on first use and then reused for every following image
+	cl::Kernel& Kernel(const string& name) {
+		auto it = kernels.find(name);
+		if (it == kernels.end()) {
+			it = kernels.emplace(name, cl::Kernel(program, name.c_str())).first;
+		}
+		return it->second;
+	}
+};
+
+//Builds the program for the first device of context
+inline DeviceState CreateDeviceState(const cl::Context& context, const string& kernel_file) {
+	DeviceState state;
+	state.context = context;
+	state.device = state.context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	//create a queue to which we will push commands for the device
+	state.queue = cl::CommandQueue(state.context, CL_QUEUE_PROFILING_ENABLE);
+
+	cl::Program::Sources sources;
+	AddSources(sources, kernel_file);
+	state.program = cl::Program(state.context, sources);
+
+	//build and debug the kernel code
+	try {
+		state.program.build();
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << state.program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(state.device) << std::endl;
+		std::cout << "Build Options:\t" << state.program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(state.device) << std::endl;
+		std::cout << "Build Log:\t " << state.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(state.device) << std::endl;
+		throw err;
+	}
+	return state;
+}
+
+inline DeviceState CreateDeviceState(int platform_id, int device_id, const string& kernel_file) {
+	cl::Context context = GetContext(platform_id, device_id);
+	if (context() == NULL) { throw cl::Error(CL_DEVICE_NOT_FOUND, "GetContext"); }
+	return CreateDeviceState(context, kernel_file);
+}
+
+//Picks the scan kernel the user asked for, Blelloch only works when the bin size is a power of 2
+inline string ScanKernelName(const string& scanName, int bin_size) {
+	string scanKernel = "scan_bl";
+	if (scanName == "hs") {
+		scanKernel = "scan_hs";
+	}
+	else if (scanName == "si") {
+		scanKernel = "simpleScan";
+	}
+	if (!(bin_size & (bin_size - 1)) == 0 && scanKernel == "scan_bl") { scanKernel = "scan_hs"; cerr << "Running on Hillis-Steele due to bin size\n"; }
+	return scanKernel;
+}
+
+//Cumulative histogram of the reference image of the match mode, computed once and shared by every image of a run
+struct ReferenceHistogram {
+	int maximum = 0;
+	vector<unsigned int> cdf;
+	cl::Buffer buffer; //device copy of cdf, when there is a device
+};
+
+//Model histogram of the backproject mode, computed once from a template and shared by every frame of a run.
+//likelihood is the frequency of each bin scaled so the most common bin is 255.
+struct ModelHistogram {
+	bool hue_saturation = false; //bin_size x bin_size hue-saturation bins instead of bin_size intensity (luma for RGB) bins
+	int bin_size = 0;
+	vector<unsigned int> frequency;
+	vector<unsigned char> likelihood;
+	cl::Buffer buffer; //device copy of likelihood, when there is a device
+};
+
+//How an image is equalized, shared by every engine
+struct EqualizeOptions {
+	int bin_size = 32;
+	string scanKernel = "scan_hs";
+	//global - one histogram over every pixel of every channel
+	//channel - a histogram and LUT per colour plane, all planes handled by the same three launches
+	//luma - RGB images only equalize Y of YCbCr, anything else is equalized as in global
+	//clahe - contrast limited adaptive equalization, a clipped histogram and LUT per tile blended bilinearly
+	//match - histogram specification, maps the image so its histogram matches reference's
+	//backproject - histogram back-projection, a single channel image of the model likelihood of every pixel's bin
+	//stretch - linear contrast stretch of everything between two percentiles of the histogram to the full 0-255 range
+	//slice - channel mode for volumes, every width x height slice of every channel with its own histogram
+	string mode = "global";
+	//Tile size in pixels and clip limit (a multiple of the average bin count) of the clahe mode.
+	//With a tile depth the tiles of a volume are boxes of that many slices blended trilinearly, otherwise the slices are stacked into one tall image.
+	int tile_width = 64;
+	int tile_height = 64;
+	int tile_depth = 0;
+	float clip_limit = 2.0f;
+	//Reference CDF of the match mode, with the same number of bins
+	shared_ptr<const ReferenceHistogram> reference;
+	//Model histogram of the backproject mode, binned with its own bin_size
+	shared_ptr<const ModelHistogram> model_histogram;
+	//Batch mode packs up to pack_images images of at most pack_max_bytes each into one set of launches, 0 or 1 turns packing off
+	int pack_images = 0;
+	size_t pack_max_bytes = 1 << 18;
+	//Clip points of the stretch mode, in hundredths of a percent
+	int stretch_low = 100;
+	int stretch_high = 9900;
+	//Statistics of every histogram are computed after equalization when set, percentiles in hundredths of a percent (at most 8)
+	bool statistics = false;
+	vector<int> percentiles{ 100, 500, 2500, 7500, 9500, 9900 };
+};
+
+//Tile grid of the clahe mode, tiles counts every tile of every plane. Slices of a volume are stacked as extra rows.
+//Tiles of the clahe mode, tile index ((c * tilesZ + tz) * tilesY + ty) * tilesX + tx.
+//A 2D grid has a depth of 1 and one tile layer.
+struct TileGrid {
+	int width, height, depth;
+	int tileDepth;
+	int tilesX, tilesY, tilesZ;
+	int tiles;
+
+	bool Volumetric() const { return depth > 1; }
+};
+
+inline TileGrid ClaheTiles(const CImg<unsigned char>& image, const EqualizeOptions& options) {
+	TileGrid grid;
+	bool volumetric = options.tile_depth > 0 && image.depth() > 1;
+	grid.width = image.width();
+	grid.height = volumetric ? image.height() : image.height() * image.depth();
+	grid.depth = volumetric ? image.depth() : 1;
+	grid.tileDepth = volumetric ? options.tile_depth : 1;
+	grid.tilesX = (grid.width + options.tile_width - 1) / options.tile_width;
+	grid.tilesY = (grid.height + options.tile_height - 1) / options.tile_height;
+	grid.tilesZ = (grid.depth + grid.tileDepth - 1) / grid.tileDepth;
+	grid.tiles = grid.tilesX * grid.tilesY * grid.tilesZ * image.spectrum();
+	return grid;
+}
+
+//Number of histograms the channel and slice modes build, one per channel or one per slice of every channel, otherwise one
+inline int HistogramPlanes(const CImg<unsigned char>& image, const string& mode) {
+	return mode == "slice" ? image.spectrum() * image.depth() : mode == "channel" ? image.spectrum() : 1;
+}
+
+//Maximum value of plane p when the image is split into planes equal runs of pixels
+inline int PlaneMaximum(const CImg<unsigned char>& image, int planes, int p) {
+	size_t planeSize = image.size() / planes;
+	const unsigned char* first = image.data() + p * planeSize;
+	return *max_element(first, first + planeSize);
+}
+
+inline size_t RoundUp(size_t n, size_t multiple) {
+	return ((n + multiple - 1) / multiple) * multiple;
+}
+
+//Largest work-group size up to preferred that the kernel can run with on this device
+inline size_t WorkGroupSize(DeviceState& state, cl::Kernel& kernel, size_t preferred) {
+	return min(preferred, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(state.device));
+}
+
+//Rectangular region of interest in pixels
+struct Roi {
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+};
+
+//Candidate alignment of a moving image against a fixed one, in pixels
+struct Shift {
+	int dx = 0;
+	int dy = 0;
+};
+
+//Device buffers for the equalization pipeline, only reallocated when an image larger than any before it arrives
+struct ImageBuffers {
+	size_t capacity = 0; //padded picture size in bytes
+	int bins = 0;
+
+	cl::Buffer dev_image_input;
+	cl::Buffer dev_image_output;
+	cl::Buffer histogram_buffer;
+	cl::Buffer cumulative_buffer;
+	cl::Buffer normalized_hist_buffer;
+	cl::Buffer frequency_buffer; //histogram_buffer copied before the scan overwrites it, when keep_frequency is set
+	bool keep_frequency = false;
+	cl::Buffer numOfBins;
+	cl::Buffer maximumValue;
+
+	//Per channel histograms, cumulative histograms, LUTs and maxima for the channel modes, per tile in the clahe mode
+	size_t channel_capacity = 0; //channels (or tiles) * bins
+	cl::Buffer channel_histograms;
+	cl::Buffer channel_cumulative;
+	cl::Buffer channel_luts;
+	cl::Buffer channel_maxima;
+
+	//Regions of interest, four ints per region
+	size_t roi_capacity = 0;
+	cl::Buffer roi_list;
+
+	//Second plane, candidate shifts, joint histograms, shards and mutual information of the joint histograms
+	size_t joint_second_capacity = 0;
+	size_t joint_shift_capacity = 0;
+	size_t joint_capacity = 0; //candidates * joint bins
+	size_t joint_shard_capacity = 0;
+	cl::Buffer joint_second;
+	cl::Buffer joint_shifts;
+	cl::Buffer joint_histograms;
+	cl::Buffer joint_shards;
+	cl::Buffer joint_information;
+
+	//Low and high clip values of the stretch mode
+	cl::Buffer stretch_clip;
+
+	//Statistics records and the requested percentiles
+	size_t statistics_capacity = 0;
+	cl::Buffer statistics_records;
+	cl::Buffer statistics_percentiles;
+
+	//Offsets and work-group table of a packed batch
+	size_t pack_offset_capacity = 0;
+	size_t pack_group_capacity = 0;
+	cl::Buffer pack_offsets;
+	cl::Buffer pack_groups;
+
+	//Host copies of the scalar arguments, these must outlive the non-blocking writes which read them
+	int bin_size_value = 0;
+	int maximum_value = 0;
+	vector<int> channel_maximum_values;
+	vector<int> roi_values;
+
+	//Client memory wrapped as the image buffers by Wrap, uploads from and downloads to it are skipped (see EnqueueUpload and
+	//EnqueueDownload). The buffers of their own are put aside until Unwrap.
+	const unsigned char* wrapped_input = nullptr;
+	unsigned char* wrapped_output = nullptr;
+	cl::Buffer own_input;
+	cl::Buffer own_output;
+	size_t own_capacity = 0;
+
+	//Buffers come from the pool and go back to it when replaced when set, otherwise they are allocated directly
+	BufferPool* pool = nullptr;
+	cl_device_id device = NULL; //the device these buffers are used on when the context has several (NUMA nodes), pooled buffers stay with it
+
+	//Replaces buffer with one of at least bytes, the one it replaces goes back to the pool. Buffers are only replaced between images,
+	//once the commands of the last image using them have completed.
+	void Allocate(cl::Buffer& buffer, const cl::Context& context, cl_mem_flags flags, size_t bytes) {
+		if (!pool) {
+			buffer = cl::Buffer(context, flags, bytes);
+			return;
+		}
+		pool->Release(buffer);
+		buffer = pool->Acquire(context, device, flags, bytes);
+	}
+
+	void Reserve(const cl::Context& context, size_t padded_size, int bin_size) {
+		//An image too large for the wrapped memory goes through buffers of its own
+		if (padded_size > capacity) { Unwrap(); }
+		if (padded_size > capacity) {
+			Allocate(dev_image_input, context, CL_MEM_READ_ONLY, padded_size);//Padding
+			Allocate(dev_image_output, context, CL_MEM_READ_WRITE, padded_size);
+			capacity = padded_size;
+		}
+		if (bin_size != bins) {
+			Allocate(histogram_buffer, context, CL_MEM_READ_WRITE, bin_size * sizeof(unsigned int));
+			Allocate(cumulative_buffer, context, CL_MEM_READ_WRITE, bin_size * sizeof(unsigned int));
+			Allocate(normalized_hist_buffer, context, CL_MEM_READ_WRITE, bin_size * sizeof(unsigned char));
+			Allocate(frequency_buffer, context, CL_MEM_READ_WRITE, bin_size * sizeof(unsigned int));
+			bins = bin_size;
+		}
+		if (numOfBins() == NULL) {
+			Allocate(numOfBins, context, CL_MEM_READ_ONLY, sizeof(int));
+			Allocate(maximumValue, context, CL_MEM_READ_ONLY, sizeof(int));
+		}
+	}
+
+	//Makes input_bytes at input and output_bytes at output the image buffers (CL_MEM_USE_HOST_PTR), so the kernels read and write
+	//that memory directly. Global mode pads the input, so images that need padding only stay wrapped if both regions have room for it.
+	//The input is never written through the buffer other than the padding.
+	void Wrap(const cl::Context& context, const unsigned char* input, size_t input_bytes, unsigned char* output, size_t output_bytes) {
+		if (!wrapped_input && !wrapped_output) {
+			own_input = dev_image_input;
+			own_output = dev_image_output;
+			own_capacity = capacity;
+		}
+		dev_image_input = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, input_bytes, (void*)input);
+		dev_image_output = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, output_bytes, output);
+		capacity = min(input_bytes, output_bytes);
+		wrapped_input = input;
+		wrapped_output = output;
+	}
+
+	//Releases the wrapped memory and goes back to the buffers of their own, once nothing enqueued uses the wrapped memory
+	void Unwrap() {
+		if (!wrapped_input && !wrapped_output) { return; }
+		dev_image_input = own_input;
+		dev_image_output = own_output;
+		capacity = own_capacity;
+		own_input = cl::Buffer();
+		own_output = cl::Buffer();
+		wrapped_input = nullptr;
+		wrapped_output = nullptr;
+	}
+
+	void ReserveChannels(const cl::Context& context, int channels, int bin_size) {
+		size_t entries = (size_t)channels * bin_size;
+		if (entries > channel_capacity) {
+			Allocate(channel_histograms, context, CL_MEM_READ_WRITE, entries * sizeof(unsigned int));
+			Allocate(channel_cumulative, context, CL_MEM_READ_WRITE, entries * sizeof(unsigned int));
+			Allocate(channel_luts, context, CL_MEM_READ_WRITE, entries * sizeof(unsigned char));
+			channel_capacity = entries;
+		}
+		if (channels > (int)channel_maximum_values.size()) {
+			Allocate(channel_maxima, context, CL_MEM_READ_ONLY, channels * sizeof(int));
+		}
+		channel_maximum_values.resize(max((int)channel_maximum_values.size(), channels));
+	}
+
+	void ReservePack(const cl::Context& context, size_t images, size_t groups) {
+		if (images + 1 > pack_offset_capacity) {
+			Allocate(pack_offsets, context, CL_MEM_READ_ONLY, (images + 1) * sizeof(unsigned int));
+			pack_offset_capacity = images + 1;
+		}
+		if (groups > pack_group_capacity) {
+			Allocate(pack_groups, context, CL_MEM_READ_ONLY, groups * 2 * sizeof(int));
+			pack_group_capacity = groups;
+		}
+	}
+
+	//shards copies of each joint histogram for shard_candidates candidates at a time
+	void ReserveJoint(const cl::Context& context, size_t second_size, size_t shard_candidates, size_t candidates, size_t joint_bins, size_t shards) {
+		if (second_size > joint_second_capacity) {
+			Allocate(joint_second, context, CL_MEM_READ_ONLY, second_size);
+			joint_second_capacity = second_size;
+		}
+		if (candidates > joint_shift_capacity) {
+			Allocate(joint_shifts, context, CL_MEM_READ_ONLY, candidates * 2 * sizeof(int));
+			Allocate(joint_information, context, CL_MEM_READ_WRITE, candidates * sizeof(float));
+			joint_shift_capacity = candidates;
+		}
+		if (candidates * joint_bins > joint_capacity) {
+			Allocate(joint_histograms, context, CL_MEM_READ_WRITE, candidates * joint_bins * sizeof(unsigned int));
+			joint_capacity = candidates * joint_bins;
+		}
+		if (shard_candidates * joint_bins * shards > joint_shard_capacity) {
+			Allocate(joint_shards, context, CL_MEM_READ_WRITE, shard_candidates * joint_bins * shards * sizeof(unsigned int));
+			joint_shard_capacity = shard_candidates * joint_bins * shards;
+		}
+	}
+
+	void ReserveStretch(const cl::Context& context) {
+		if (stretch_clip() == NULL) {
+			Allocate(stretch_clip, context, CL_MEM_READ_WRITE, 2 * sizeof(int));
+		}
+	}
+
+	void ReserveStatistics(const cl::Context& context, size_t histograms, size_t record_size) {
+		if (histograms > statistics_capacity) {
+			Allocate(statistics_records, context, CL_MEM_WRITE_ONLY, histograms * record_size);
+			statistics_capacity = histograms;
+		}
+		if (statistics_percentiles() == NULL) {
+			Allocate(statistics_percentiles, context, CL_MEM_READ_ONLY, 8 * sizeof(int));
+		}
+	}
+
+	void ReserveRois(const cl::Context& context, size_t rois) {
+		if (rois > roi_capacity) {
+			Allocate(roi_list, context, CL_MEM_READ_ONLY, rois * 4 * sizeof(int));
+			roi_capacity = rois;
+		}
+	}
+
+	//Gives every buffer back to the pool for other buffers to use, once nothing enqueued uses them
+	void ReleaseToPool() {
+		if (!pool) { return; }
+		Unwrap();
+		for (cl::Buffer* buffer : { &dev_image_input, &dev_image_output, &histogram_buffer, &cumulative_buffer, &normalized_hist_buffer, &frequency_buffer, &numOfBins, &maximumValue,
+			&channel_histograms, &channel_cumulative, &channel_luts, &channel_maxima, &roi_list, &joint_second, &joint_shifts, &joint_histograms, &joint_shards,
+			&joint_information, &stretch_clip, &statistics_records, &statistics_percentiles, &pack_offsets, &pack_groups }) {
+			pool->Release(*buffer);
+		}
+		capacity = bins = 0;
+		channel_capacity = roi_capacity = joint_second_capacity = joint_shift_capacity = joint_capacity = joint_shard_capacity = 0;
+		statistics_capacity = pack_offset_capacity = pack_group_capacity = 0;
+		channel_maximum_values.clear();
+	}
+};
+
+//Copies an image to dev_image_input, nothing to copy when the buffer wraps the image's own memory
+inline void EnqueueUpload(cl::CommandQueue& queue, ImageBuffers& buffers, const unsigned char* pixels, size_t size) {
+	if (pixels == buffers.wrapped_input) { return; }
+	queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, size, pixels);
+}
+
+//Reads dev_image_output into pixels. When the buffer wraps pixels the kernels already wrote there, mapping it only makes their writes
+//visible to the host (without a copy wherever the device shares host memory). done is set either way.
+inline void EnqueueDownload(cl::CommandQueue& queue, ImageBuffers& buffers, unsigned char* pixels, size_t size, cl::Event& done) {
+	if (pixels != buffers.wrapped_output) {
+		queue.enqueueReadBuffer(buffers.dev_image_output, CL_FALSE, 0, size, pixels, NULL, &done);
+		return;
+	}
+	void* mapped = queue.enqueueMapBuffer(buffers.dev_image_output, CL_FALSE, CL_MAP_READ, 0, size);
+	queue.enqueueUnmapMemObject(buffers.dev_image_output, mapped, NULL, &done);
+}
+
+//Intermediate results, only read back from the device when asked for.
+//In the channel modes each vector holds one run of bins per channel, in the clahe mode one per tile (after clipping).
+struct Histograms {
+	int channels = 1;
+	std::vector<unsigned int> frequency;
+	std::vector<unsigned int> cumulative;
+	std::vector<unsigned char> normalized;
+};
+
+//Writes the histograms next to an output image. A .csv file gets one "bin,frequency,cumulative,lut" row per bin
+//(with a leading channel column when there is more than one channel), anything else is binary with one record per
+//channel: the bin count (int32), frequency and cumulative (uint32 per bin) then the LUT (uint8 per bin)
+inline void WriteHistogramSidecar(const string& filename, const Histograms& histograms) {
+	int bins = (int)histograms.frequency.size() / histograms.channels;
+	string ext = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	if (ext == ".csv") {
+		ofstream file(filename);
+		file << (histograms.channels > 1 ? "channel," : "") << "bin,frequency,cumulative,lut" << endl;
+		for (int c = 0; c < histograms.channels; c++) {
+			for (int i = 0; i < bins; i++) {
+				int k = c * bins + i;
+				if (histograms.channels > 1) { file << c << ","; }
+				file << i << "," << histograms.frequency[k] << "," << histograms.cumulative[k] << "," << (int)histograms.normalized[k] << endl;
+			}
+		}
+	}
+	else {
+		ofstream file(filename, ios::binary);
+		for (int c = 0; c < histograms.channels; c++) {
+			file.write((const char*)&bins, sizeof(int));
+			file.write((const char*)&histograms.frequency[c * bins], bins * sizeof(unsigned int));
+			file.write((const char*)&histograms.cumulative[c * bins], bins * sizeof(unsigned int));
+			file.write((const char*)&histograms.normalized[c * bins], bins * sizeof(unsigned char));
+		}
+	}
+}
+
+//Buffer holding the cumulative histogram of the global and luma modes after the scan, Blelloch scans in place
+inline cl::Buffer& CumulativeBuffer(ImageBuffers& buffers, const string& scanKernel) {
+	return scanKernel == "scan_bl" ? buffers.histogram_buffer : buffers.cumulative_buffer;
+}
+
+//Enqueues the scan of histogram_buffer, the result is left in CumulativeBuffer. Every scan writes over histogram_buffer, so it is
+//copied to frequency_buffer first when the frequencies are wanted afterwards.
+inline void EnqueueScan(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, int bin_size, const string& scanKernel) {
+	if (buffers.keep_frequency) {
+		queue.enqueueCopyBuffer(buffers.histogram_buffer, buffers.frequency_buffer, 0, 0, bin_size * sizeof(unsigned int));
+	}
+	cl::Kernel& cumulativeKern = state.Kernel(scanKernel); //Kernel to calculate cumulative histogram values
+	cumulativeKern.setArg(0, buffers.histogram_buffer);
+	cumulativeKern.setArg(1, buffers.cumulative_buffer);
+
+	//Kernel for calculating the cumulative histogram values
+	queue.enqueueNDRangeKernel(cumulativeKern, cl::NullRange, cl::NDRange(bin_size), cl::NullRange);
+}
+
+//Enqueues the scan of histogram_buffer and its normalization into normalized_hist_buffer, shared by the modes with a single histogram.
+//With a reference the LUT is the inverse of the reference CDF instead.
+inline void EnqueueScanNormalize(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, int bin_size, const string& scanKernel, const ReferenceHistogram* reference = nullptr) {
+	EnqueueScan(state, queue, buffers, bin_size, scanKernel);
+	cl::Buffer& cumulative = CumulativeBuffer(buffers, scanKernel);
+
+	if (reference) {
+		cl::Kernel& matchKern = state.Kernel("matchHistogram"); //Kernel to invert the reference CDF
+		matchKern.setArg(0, cumulative);
+		matchKern.setArg(1, reference->buffer);
+		matchKern.setArg(2, buffers.normalized_hist_buffer);
+		matchKern.setArg(3, (int)reference->cdf.size());
+		matchKern.setArg(4, reference->maximum);
+		//Kernel for matching the cumulative histogram to the reference
+		queue.enqueueNDRangeKernel(matchKern, cl::NullRange, cl::NDRange(bin_size), cl::NullRange);
+	}
+	else {
+		cl::Kernel& normalizeKern = state.Kernel("normHistogramVals"); //Kernel to normalize histogram values
+		normalizeKern.setArg(0, cumulative);
+		normalizeKern.setArg(1, buffers.maximumValue);
+		normalizeKern.setArg(2, buffers.normalized_hist_buffer);
+		//Kernel for normalizing the histogram
+		queue.enqueueNDRangeKernel(normalizeKern, cl::NullRange, cl::NDRange(bin_size), cl::NullRange);
+	}
+}
+
+//Uploads the image and enqueues its histogram over every pixel into histogram_buffer, shared by the global and stretch modes
+inline void EnqueueHistogramGlobal(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, int bin_size) {
+	size_t vector_elements = bin_size;//number of elements
+	size_t vector_size = bin_size * sizeof(unsigned int);//size in bytes
+	size_t picture_size = image_input.size() * sizeof(unsigned char); //size of picture in bytes
+	size_t single_int_size = sizeof(int);
+
+	//Padding Calculation
+	int numberToAdd = bin_size - (image_input.size() % bin_size); // Calculates the number of elements to pad by
+	if (numberToAdd == bin_size) { numberToAdd = 0; } // Sets number to add to 0, if it equals the number of bins
+	size_t padded_size = picture_size + (numberToAdd * sizeof(unsigned char));
+
+	buffers.Reserve(state.context, padded_size, bin_size);
+	buffers.bin_size_value = bin_size;
+	//Get the maximum value of a pixel from the image
+	buffers.maximum_value = image_input.max();
+
+	//Copy data to device memory, the padding and histogram are zeroed as the buffers are reused between images
+	EnqueueUpload(queue, buffers, image_input.data(), picture_size);
+	if (numberToAdd > 0) {
+		queue.enqueueFillBuffer(buffers.dev_image_input, (cl_uchar)0, picture_size, numberToAdd * sizeof(unsigned char));
+	}
+	queue.enqueueFillBuffer(buffers.histogram_buffer, (cl_uint)0, 0, vector_size);
+	queue.enqueueWriteBuffer(buffers.numOfBins, CL_FALSE, 0, single_int_size, &buffers.bin_size_value);
+	queue.enqueueWriteBuffer(buffers.maximumValue, CL_FALSE, 0, single_int_size, &buffers.maximum_value);
+
+	//Set the kernel arguments, the buffers may have been reallocated since the last image.
+	//Arguments are captured at enqueue time so the kernels can be shared between queues.
+	cl::Kernel& histogramKern = state.Kernel("histogramVals"); //Kernel to calculate the histogram values
+	histogramKern.setArg(0, buffers.dev_image_input);
+	histogramKern.setArg(1, buffers.numOfBins);
+	histogramKern.setArg(2, buffers.maximumValue);
+	histogramKern.setArg(3, buffers.histogram_buffer);
+	histogramKern.setArg(4, cl::Local(vector_size));
+
+	cl::Kernel& unpadKern = state.Kernel("unpadHistogram"); //Kernel to remove the padded values from the histogram
+	unpadKern.setArg(0, buffers.histogram_buffer);
+	unpadKern.setArg(1, numberToAdd);
+
+	//Kernel for calculating the histogram values
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(image_input.size() + numberToAdd), cl::NDRange(vector_elements));
+	//Removes the extra padded values from the intensity histogram on the device, so nothing has to be read back
+	if (numberToAdd > 0) {
+		queue.enqueueNDRangeKernel(unpadKern, cl::NullRange, cl::NDRange(1), cl::NullRange);
+	}
+}
+
+//Global mode, one histogram over every pixel
+inline void EnqueueEqualizeGlobal(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, int bin_size, const string& scanKernel, cl::Event& done, const ReferenceHistogram* reference = nullptr) {
+	size_t picture_size = image_input.size() * sizeof(unsigned char); //size of picture in bytes
+	EnqueueHistogramGlobal(state, queue, buffers, image_input, bin_size);
+
+	cl::Kernel& mapKern = state.Kernel("mapHistogram"); //Kernel to map histogram values
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.normalized_hist_buffer);
+	mapKern.setArg(2, buffers.maximumValue);
+	mapKern.setArg(3, buffers.numOfBins);
+	mapKern.setArg(4, buffers.dev_image_output);
+
+	//Cumulative histogram and normalization
+	EnqueueScanNormalize(state, queue, buffers, bin_size, scanKernel, reference);
+	//Kernel for mapping the histogram to the image
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange);
+
+	//Copy the resulting image from device to host
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+}
+
+//Stretch mode, the clip points are found from the cumulative histogram on the device and a linear map is applied with the
+//launch shape of mapHistogram, so the histogram never comes back to the host
+inline void EnqueueStretch(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const EqualizeOptions& options, cl::Event& done) {
+	int bin_size = options.bin_size;
+	size_t picture_size = image_input.size() * sizeof(unsigned char);
+	EnqueueHistogramGlobal(state, queue, buffers, image_input, bin_size);
+	EnqueueScan(state, queue, buffers, bin_size, options.scanKernel);
+	buffers.ReserveStretch(state.context);
+
+	//Every bin's stretched value goes to normalized_hist_buffer, as the LUT of the other modes
+	cl::Kernel& clipKern = state.Kernel("stretchLut");
+	clipKern.setArg(0, CumulativeBuffer(buffers, options.scanKernel));
+	clipKern.setArg(1, buffers.maximumValue);
+	clipKern.setArg(2, buffers.stretch_clip);
+	clipKern.setArg(3, buffers.normalized_hist_buffer);
+	clipKern.setArg(4, options.stretch_low);
+	clipKern.setArg(5, options.stretch_high);
+	queue.enqueueNDRangeKernel(clipKern, cl::NullRange, cl::NDRange(bin_size), cl::NullRange);
+
+	cl::Kernel& mapKern = state.Kernel("mapStretch");
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.stretch_clip);
+	mapKern.setArg(2, buffers.dev_image_output);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange);
+
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+}
+
+//Channel mode, C histograms built in a single pass, scanned and normalized in one launch and mapped each with its own LUT.
+//The slice mode runs the same launches with one plane per slice of every channel.
+inline void EnqueueEqualizeChannels(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, int bin_size, cl::Event& done, int channels) {
+	int planeSize = (int)(image_input.size() / channels);
+	size_t picture_size = image_input.size() * sizeof(unsigned char);
+
+	buffers.Reserve(state.context, picture_size, bin_size);
+	buffers.ReserveChannels(state.context, channels, bin_size);
+	for (int c = 0; c < channels; c++) {
+		buffers.channel_maximum_values[c] = PlaneMaximum(image_input, channels, c);
+	}
+
+	EnqueueUpload(queue, buffers, image_input.data(), picture_size);
+	queue.enqueueWriteBuffer(buffers.channel_maxima, CL_FALSE, 0, channels * sizeof(int), buffers.channel_maximum_values.data());
+	queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, channels * bin_size * sizeof(unsigned int));
+
+	cl::Kernel& histogramKern = state.Kernel("histogramChannels");
+	histogramKern.setArg(0, buffers.dev_image_input);
+	histogramKern.setArg(1, buffers.channel_maxima);
+	histogramKern.setArg(2, buffers.channel_histograms);
+	histogramKern.setArg(3, cl::Local(bin_size * sizeof(unsigned int)));
+	histogramKern.setArg(4, planeSize);
+	histogramKern.setArg(5, bin_size);
+	size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(RoundUp(planeSize, histogramGroup), channels), cl::NDRange(histogramGroup, 1));
+
+	cl::Kernel& scanKern = state.Kernel("scanChannels");
+	size_t scanGroup = WorkGroupSize(state, scanKern, 256);
+	scanKern.setArg(0, buffers.channel_histograms);
+	scanKern.setArg(1, buffers.channel_maxima);
+	scanKern.setArg(2, buffers.channel_cumulative);
+	scanKern.setArg(3, buffers.channel_luts);
+	scanKern.setArg(4, cl::Local(2 * scanGroup * sizeof(unsigned int)));
+	scanKern.setArg(5, bin_size);
+	queue.enqueueNDRangeKernel(scanKern, cl::NullRange, cl::NDRange(scanGroup * channels), cl::NDRange(scanGroup));
+
+	cl::Kernel& mapKern = state.Kernel("mapChannels");
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.channel_luts);
+	mapKern.setArg(2, buffers.channel_maxima);
+	mapKern.setArg(3, buffers.dev_image_output);
+	mapKern.setArg(4, planeSize);
+	mapKern.setArg(5, bin_size);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange);
+
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+}
+
+//Luma mode for RGB images, only Y of YCbCr is equalized so hues are kept.
+//The conversion is fused into the histogram and map kernels, each pixel is read twice and written once in all.
+inline void EnqueueEqualizeLuma(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, int bin_size, const string& scanKernel, cl::Event& done) {
+	int planeSize = (int)(image_input.size() / 3);
+	size_t picture_size = image_input.size() * sizeof(unsigned char);
+
+	buffers.Reserve(state.context, picture_size, bin_size);
+	buffers.bin_size_value = bin_size;
+	//Luma never exceeds the brightest channel, so the image maximum bounds it as in the global mode
+	buffers.maximum_value = image_input.max();
+
+	EnqueueUpload(queue, buffers, image_input.data(), picture_size);
+	queue.enqueueFillBuffer(buffers.histogram_buffer, (cl_uint)0, 0, bin_size * sizeof(unsigned int));
+	queue.enqueueWriteBuffer(buffers.numOfBins, CL_FALSE, 0, sizeof(int), &buffers.bin_size_value);
+	queue.enqueueWriteBuffer(buffers.maximumValue, CL_FALSE, 0, sizeof(int), &buffers.maximum_value);
+
+	cl::Kernel& histogramKern = state.Kernel("histogramLuma");
+	histogramKern.setArg(0, buffers.dev_image_input);
+	histogramKern.setArg(1, buffers.numOfBins);
+	histogramKern.setArg(2, buffers.maximumValue);
+	histogramKern.setArg(3, buffers.histogram_buffer);
+	histogramKern.setArg(4, cl::Local(bin_size * sizeof(unsigned int)));
+	histogramKern.setArg(5, planeSize);
+	//The work-group size is the bin count, as with histogramVals
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(RoundUp(planeSize, bin_size)), cl::NDRange(bin_size));
+
+	EnqueueScanNormalize(state, queue, buffers, bin_size, scanKernel);
+
+	cl::Kernel& mapKern = state.Kernel("mapLuma");
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.normalized_hist_buffer);
+	mapKern.setArg(2, buffers.maximumValue);
+	mapKern.setArg(3, buffers.numOfBins);
+	mapKern.setArg(4, buffers.dev_image_output);
+	mapKern.setArg(5, planeSize);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(planeSize), cl::NullRange);
+
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+}
+
+//Volumetric clahe, the histograms of tiles [first_tile, first_tile + tiles) into channel_histograms.
+//input holds whole planes (width x height slices of one channel) from first_plane on, which must cover those tiles.
+inline void EnqueueClaheHistograms3D(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const cl::Buffer& input, const TileGrid& grid, const EqualizeOptions& options, int maximum, int first_plane, int first_tile, int tiles) {
+	cl::Kernel& histogramKern = state.Kernel("claheHistograms3D");
+	histogramKern.setArg(0, input);
+	histogramKern.setArg(1, buffers.channel_histograms);
+	histogramKern.setArg(2, cl::Local(options.bin_size * sizeof(unsigned int)));
+	histogramKern.setArg(3, cl_int4{ { grid.width, grid.height, grid.depth, first_plane } });
+	histogramKern.setArg(4, cl_int4{ { options.tile_width, options.tile_height, grid.tileDepth, 0 } });
+	histogramKern.setArg(5, cl_int4{ { grid.tilesX, grid.tilesY, grid.tilesZ, first_tile } });
+	histogramKern.setArg(6, options.bin_size);
+	histogramKern.setArg(7, maximum);
+	//One work-group per tile
+	size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(histogramGroup * tiles), cl::NDRange(histogramGroup));
+}
+
+//Volumetric clahe, the trilinear map of planes voxels of input starting at plane first_plane into output
+inline void EnqueueClaheMap3D(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const cl::Buffer& input, const cl::Buffer& output, const TileGrid& grid, const EqualizeOptions& options, int maximum, int first_plane, size_t voxels) {
+	cl::Kernel& mapKern = state.Kernel("claheMap3D");
+	mapKern.setArg(0, input);
+	mapKern.setArg(1, buffers.channel_luts);
+	mapKern.setArg(2, output);
+	mapKern.setArg(3, cl_int4{ { grid.width, grid.height, grid.depth, first_plane } });
+	mapKern.setArg(4, cl_int4{ { options.tile_width, options.tile_height, grid.tileDepth, 0 } });
+	mapKern.setArg(5, cl_int4{ { grid.tilesX, grid.tilesY, grid.tilesZ, 0 } });
+	mapKern.setArg(6, options.bin_size);
+	mapKern.setArg(7, maximum);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(voxels), cl::NullRange);
+}
+
+//Clips every tile histogram in channel_histograms and builds its LUT, shared by the 2D and volumetric clahe
+inline void EnqueueClaheLuts(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const TileGrid& grid, const EqualizeOptions& options, int maximum) {
+	cl::Kernel& lutKern = state.Kernel("claheLuts");
+	lutKern.setArg(0, buffers.channel_histograms);
+	lutKern.setArg(1, buffers.channel_cumulative);
+	lutKern.setArg(2, buffers.channel_luts);
+	lutKern.setArg(3, grid.tiles);
+	lutKern.setArg(4, options.bin_size);
+	lutKern.setArg(5, (int)(options.clip_limit * 256));
+	lutKern.setArg(6, maximum);
+	queue.enqueueNDRangeKernel(lutKern, cl::NullRange, cl::NDRange(RoundUp(grid.tiles, 64)), cl::NullRange);
+}
+
+//Clahe mode, three launches whatever the number of tiles: every tile histogram, every clipped LUT, then the bilinear map.
+//Volumes with a tile depth use box tiles and a trilinear map instead.
+inline void EnqueueEqualizeClahe(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const EqualizeOptions& options, cl::Event& done) {
+	TileGrid grid = ClaheTiles(image_input, options);
+	int bin_size = options.bin_size;
+	int maximum = image_input.max();
+	size_t picture_size = image_input.size() * sizeof(unsigned char);
+
+	buffers.Reserve(state.context, picture_size, bin_size);
+	buffers.ReserveChannels(state.context, grid.tiles, bin_size);
+	EnqueueUpload(queue, buffers, image_input.data(), picture_size);
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+
+	if (grid.Volumetric()) {
+		EnqueueClaheHistograms3D(state, queue, buffers, buffers.dev_image_input, grid, options, maximum, 0, 0, grid.tiles);
+		EnqueueClaheLuts(state, queue, buffers, grid, options, maximum);
+		EnqueueClaheMap3D(state, queue, buffers, buffers.dev_image_input, buffers.dev_image_output, grid, options, maximum, 0, image_input.size());
+		EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+		return;
+	}
+
+	cl::Kernel& histogramKern = state.Kernel("claheHistograms");
+	histogramKern.setArg(0, buffers.dev_image_input);
+	histogramKern.setArg(1, buffers.channel_histograms);
+	histogramKern.setArg(2, cl::Local(bin_size * sizeof(unsigned int)));
+	histogramKern.setArg(3, grid.width);
+	histogramKern.setArg(4, grid.height);
+	histogramKern.setArg(5, options.tile_width);
+	histogramKern.setArg(6, options.tile_height);
+	histogramKern.setArg(7, grid.tilesX);
+	histogramKern.setArg(8, grid.tilesY);
+	histogramKern.setArg(9, bin_size);
+	histogramKern.setArg(10, maximum);
+	//One work-group per tile
+	size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(histogramGroup * grid.tiles), cl::NDRange(histogramGroup));
+
+	EnqueueClaheLuts(state, queue, buffers, grid, options, maximum);
+
+	cl::Kernel& mapKern = state.Kernel("claheMap");
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.channel_luts);
+	mapKern.setArg(2, buffers.dev_image_output);
+	mapKern.setArg(3, grid.width);
+	mapKern.setArg(4, grid.height);
+	mapKern.setArg(5, options.tile_width);
+	mapKern.setArg(6, options.tile_height);
+	mapKern.setArg(7, grid.tilesX);
+	mapKern.setArg(8, grid.tilesY);
+	mapKern.setArg(9, bin_size);
+	mapKern.setArg(10, maximum);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange);
+
+	EnqueueDownload(queue, buffers, output_image.data(), picture_size, done);
+}
+
+//The sidecar of the backproject mode is the model's histogram, its cumulative histogram and the likelihood of every bin
+inline void ModelHistograms(const ModelHistogram& model, Histograms* histograms) {
+	histograms->channels = 1;
+	histograms->frequency = model.frequency;
+	histograms->cumulative.resize(model.frequency.size());
+	unsigned int sum = 0;
+	for (size_t i = 0; i < model.frequency.size(); i++) {
+		sum += model.frequency[i];
+		histograms->cumulative[i] = sum;
+	}
+	histograms->normalized = model.likelihood;
+}
+
+//Backproject mode, one fused launch bins every pixel and looks up its likelihood in the model, the image's own histogram is never built.
+//The output has a single channel whatever the input has.
+inline void EnqueueBackProject(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const ModelHistogram& model, cl::Event& done) {
+	int channels = image_input.spectrum();
+	int planeSize = (int)(image_input.size() / channels);
+	size_t picture_size = image_input.size() * sizeof(unsigned char);
+
+	buffers.Reserve(state.context, picture_size, model.bin_size);
+	EnqueueUpload(queue, buffers, image_input.data(), picture_size);
+
+	cl::Kernel& backProjectKern = state.Kernel("backProject");
+	backProjectKern.setArg(0, buffers.dev_image_input);
+	backProjectKern.setArg(1, model.buffer);
+	backProjectKern.setArg(2, buffers.dev_image_output);
+	backProjectKern.setArg(3, planeSize);
+	backProjectKern.setArg(4, channels);
+	backProjectKern.setArg(5, model.bin_size);
+	backProjectKern.setArg(6, model.hue_saturation ? 1 : 0);
+	queue.enqueueNDRangeKernel(backProjectKern, cl::NullRange, cl::NDRange(planeSize), cl::NullRange);
+
+	output_image.assign(image_input.width(), image_input.height(), image_input.depth(), 1);
+	EnqueueDownload(queue, buffers, output_image.data(), planeSize, done);
+}
+
+//Enqueues histogram -> scan -> normalize -> map for a single image without waiting for any of it.
+//The input and output images must stay alive until done has completed.
+inline void EnqueueEqualize(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image, const EqualizeOptions& options, cl::Event& done) {
+	if (options.mode == "backproject") {
+		EnqueueBackProject(state, queue, buffers, image_input, output_image, *options.model_histogram, done);
+	}
+	else if (options.mode == "stretch") {
+		EnqueueStretch(state, queue, buffers, image_input, output_image, options, done);
+	}
+	else if (options.mode == "channel" || options.mode == "slice") {
+		EnqueueEqualizeChannels(state, queue, buffers, image_input, output_image, options.bin_size, done, HistogramPlanes(image_input, options.mode));
+	}
+	else if (options.mode == "clahe") {
+		EnqueueEqualizeClahe(state, queue, buffers, image_input, output_image, options, done);
+	}
+	else if (options.mode == "luma" && image_input.spectrum() == 3) {
+		EnqueueEqualizeLuma(state, queue, buffers, image_input, output_image, options.bin_size, options.scanKernel, done);
+	}
+	else {
+		EnqueueEqualizeGlobal(state, queue, buffers, image_input, output_image, options.bin_size, options.scanKernel, done, options.mode == "match" ? options.reference.get() : nullptr);
+	}
+}
+
+//Runs histogram -> scan -> normalize -> map for a single image on the device and waits for the result
+inline CImg<unsigned char> EqualizeImage(DeviceState& state, ImageBuffers& buffers, const CImg<unsigned char>& image_input, const EqualizeOptions& options, cl::Event& profEvent, Histograms* histograms = nullptr) {
+	CImg<unsigned char> output_image;
+	buffers.keep_frequency = histograms != nullptr;
+	EnqueueEqualize(state, state.queue, buffers, image_input, output_image, options, profEvent);
+	buffers.keep_frequency = false;
+
+	if (histograms && options.mode == "backproject") {
+		ModelHistograms(*options.model_histogram, histograms);
+	}
+	else if (histograms) {
+		//The channel, slice and clahe modes have one run of bins per channel, per slice or per tile
+		bool perChannel = options.mode == "channel" || options.mode == "slice" || options.mode == "clahe";
+		histograms->channels = options.mode == "clahe" ? ClaheTiles(image_input, options).tiles : HistogramPlanes(image_input, options.mode);
+		size_t entries = (size_t)histograms->channels * options.bin_size;
+		histograms->frequency.resize(entries);
+		histograms->cumulative.resize(entries);
+		histograms->normalized.resize(entries);
+		state.queue.enqueueReadBuffer(perChannel ? buffers.channel_histograms : buffers.frequency_buffer, CL_TRUE, 0, entries * sizeof(unsigned int), &histograms->frequency[0]);
+		state.queue.enqueueReadBuffer(perChannel ? buffers.channel_cumulative : CumulativeBuffer(buffers, options.scanKernel), CL_TRUE, 0, entries * sizeof(unsigned int), &histograms->cumulative[0]);
+		state.queue.enqueueReadBuffer(perChannel ? buffers.channel_luts : buffers.normalized_hist_buffer, CL_TRUE, 0, entries * sizeof(unsigned char), &histograms->normalized[0]);
+	}
+	profEvent.wait();
+	return output_image;
+}
+
+} //namespace histeq
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+#include "CostModel.h"
+#include "Reference.h"
+#include "BackProjection.h"
+#include "MultiDevice.h"
+#include "Pipeline.h"
+#include "Video.h"
+#include "Stream.h"
+#include "Daemon.h"
+#include "Roi.h"
+#include "Joint.h"
+#include "Statistics.h"
+#include "Volume.h"
+
+namespace histeq {
+
+//What a HistogramEqualizer runs on and with, the command line options of the same names
+struct EqualizerSettings {
+	string engine = "cl"; //cl - OpenCL, cpu - the native engine, auto - per image from the measured cost model
+	int platform_id = 0;
+	int device_id = 0;
+	bool numa = false; //split the device by NUMA node
+	string kernel_file = "kernels/my_kernels.cl";
+	string scan = "hs"; //bl, hs or si, Blelloch falls back to Hillis-Steele when the bin size is not a power of 2
+	int cpu_threads = (int)std::thread::hardware_concurrency();
+	EqualizeOptions options; //scanKernel is set from scan
+	string reference_filename; //match mode
+	string model_spec; //backproject mode
+	bool hue_saturation = false;
+	string cost_cache; //auto engine
+	bool verbose = false;
+};
+
+//The equalization engine on its own, for embedding: the context, queues, program, kernels, buffers and the CPU engine are set up once
+//in the constructor and reused by every call. When no OpenCL platform or device is found it runs on the CPU engine (see FallbackReason).
+//Like every header in include/ it declares everything in namespace histeq, and any number of translation units can include it.
+//The batch, stream, daemon, region, joint, volume and multi-device runners are methods too, so a program only needs this class.
+//Calls are expected from one thread at a time, apart from EqualizeOnCpu, EqualizeAsync and TryEnqueue, which may run alongside them
+//from any number of threads: the asynchronous calls have queues, buffers and kernel objects of their own.
+class HistogramEqualizer {
+public:
+	explicit HistogramEqualizer(const EqualizerSettings& settings) : cpu(max(1, settings.cpu_threads)), kernel_file(settings.kernel_file) {
+		options = settings.options;
+		options.scanKernel = ScanKernelName(settings.scan, options.bin_size);
+		use_device = settings.engine != "cpu";
+		if (use_device) {
+			try {
+				state = settings.numa ? CreateNumaDeviceState(settings.platform_id, settings.device_id, settings.kernel_file) : CreateDeviceState(settings.platform_id, settings.device_id, settings.kernel_file);
+			}
+			catch (const cl::Error& err) {
+				//Without a platform or device there is still the native engine
+				if (err.err() != CL_PLATFORM_NOT_FOUND_KHR && err.err() != CL_DEVICE_NOT_FOUND) { throw; }
+				fallback_reason = getErrorString(err.err());
+				use_device = false;
+			}
+		}
+
+		if (options.mode == "match") { options.reference = LoadReferenceHistogram(settings.reference_filename, Device(), cpu, options); }
+		if (options.mode == "backproject") { options.model_histogram = LoadModelHistogram(settings.model_spec, Device(), settings.hue_saturation, options.bin_size); }
+		use_cost_model = use_device && settings.engine == "auto";
+		if (use_cost_model) { model = GetCostModel(state, cpu, options, settings.cost_cache, settings.verbose); }
+
+		if (use_device) {
+			buffers.pool = state.pool.get();
+			//Kernel arguments are set on the kernel objects, so TryEnqueue builds its own from the same program
+			async_state = state;
+			async_state.kernels.clear();
+			for (AsyncSlot& slot : slots) {
+				slot.queue = cl::CommandQueue(state.context, state.device, CL_QUEUE_PROFILING_ENABLE);
+				slot.buffers.pool = state.pool.get();
+			}
+		}
+	}
+
+	~HistogramEqualizer() {
+		for (AsyncSlot& slot : slots) {
+			if (slot.done()) { slot.done.wait(); }
+		}
+		{
+			lock_guard<mutex> lock(cpu_jobs_guard);
+			closing = true;
+			cpu_jobs_ready.notify_all();
+		}
+		if (cpu_worker.joinable()) { cpu_worker.join(); }
+	}
+
+	HistogramEqualizer(const HistogramEqualizer&) = delete;
+	HistogramEqualizer& operator=(const HistogramEqualizer&) = delete;
+
+	//The histogram of every pixel, bin_size bins binned with the image's maximum as in the global mode
+	vector<unsigned int> ComputeHistogram(const CImg<unsigned char>& image) {
+		if (!use_device) { return cpu.Histogram(image.data(), image.size(), image.max(), options.bin_size); }
+		vector<unsigned int> frequency(options.bin_size);
+		cl::Event done;
+		EnqueueHistogramGlobal(state, state.queue, buffers, image, options.bin_size);
+		state.queue.enqueueReadBuffer(buffers.histogram_buffer, CL_TRUE, 0, options.bin_size * sizeof(unsigned int), frequency.data(), NULL, &done);
+		RanOnDevice(done);
+		return frequency;
+	}
+
+	//As ComputeHistogram, of width x height x depth x spectrum pixels in the caller's memory
+	vector<unsigned int> ComputeHistogram(const unsigned char* input, int width, int height, int depth = 1, int spectrum = 1) {
+		//CImg has no const views, the input is only read
+		return ComputeHistogram(CImg<unsigned char>((unsigned char*)input, width, height, depth, spectrum, true));
+	}
+
+	//Equalizes an image on the device or, with the auto engine, wherever the cost model expects it to finish first.
+	//histograms gets the intermediate results when given.
+	CImg<unsigned char> Equalize(const CImg<unsigned char>& image, Histograms* histograms = nullptr) {
+		if (!PrefersDevice(image.size())) { return EqualizeOnCpu(image, histograms); }
+		cl::Event done;
+		CImg<unsigned char> output = EqualizeImage(state, buffers, image, options, done, histograms);
+		RanOnDevice(done);
+		return output;
+	}
+
+	//Equalizes an image on the CPU engine whatever the engine, from any number of threads (the engine takes one image at a time)
+	CImg<unsigned char> EqualizeOnCpu(const CImg<unsigned char>& image, Histograms* histograms = nullptr) {
+		auto start = std::chrono::steady_clock::now();
+		CImg<unsigned char> output = cpu.Equalize(image, options, histograms);
+		RanOnCpu(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		return output;
+	}
+
+	//Equalizes width x height x depth x spectrum pixels in CImg's planar layout from input into output, both the caller's memory.
+	//output holds width x height x depth x OutputChannels(spectrum) pixels.
+	void Equalize(const unsigned char* input, unsigned char* output, int width, int height, int depth = 1, int spectrum = 1) {
+		EqualizeAsync(input, output, width, height, depth, spectrum).get();
+	}
+
+	//As Equalize, returning as soon as the work is enqueued. The device alternates between two queues with their own buffers, so one image
+	//uploads while the one before computes, and only waits here when both are still busy. Images for the CPU engine are queued and run
+	//in order, one at a time, on a thread of its own. input and output must stay alive until the future is ready.
+	future<void> EqualizeAsync(const unsigned char* input, unsigned char* output, int width, int height, int depth = 1, int spectrum = 1) {
+		//CImg has no const views, the input is only read
+		CImg<unsigned char> image((unsigned char*)input, width, height, depth, spectrum, true);
+		if (!PrefersDevice(image.size())) {
+			packaged_task<void()> job([this, image, output]() {
+				CImg<unsigned char> equalized = EqualizeOnCpu(image);
+				memcpy(output, equalized.data(), equalized.size());
+			});
+			future<void> result = job.get_future();
+			lock_guard<mutex> lock(cpu_jobs_guard);
+			if (!cpu_worker.joinable()) { cpu_worker = thread(&HistogramEqualizer::RunCpuJobs, this); }
+			cpu_jobs.push_back(std::move(job));
+			cpu_jobs_ready.notify_one();
+			return result;
+		}
+
+		cl::Event done;
+		while (!TryEnqueue(input, output, width, height, depth, spectrum, done)) { done.wait(); }
+		return std::async(std::launch::deferred, [done] { done.wait(); });
+	}
+
+	//The device side of EqualizeAsync without blocking: enqueues the image on the next slot and returns true with done set to its
+	//event, or returns false with done set to the event the slot is still busy with (its buffers and host scalars are reused).
+	//Safe to call from several threads at once, for the coroutine interface (Coroutine.h).
+	bool TryEnqueue(const unsigned char* input, unsigned char* output, int width, int height, int depth, int spectrum, cl::Event& done) {
+		lock_guard<mutex> lock(slot_guard);
+		AsyncSlot& slot = slots[next_slot % slot_count];
+		if (slot.done() && slot.done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) {
+			done = slot.done;
+			return false;
+		}
+		next_slot++;
+		CImg<unsigned char> image((unsigned char*)input, width, height, depth, spectrum, true);
+		CImg<unsigned char> result(output, width, height, depth, OutputChannels(spectrum), true);
+		EnqueueEqualize(async_state, slot.queue, slot.buffers, image, result, options, slot.done);
+		slot.queue.flush();
+		RanOnDevice(slot.done);
+		done = slot.done;
+		return true;
+	}
+
+	//Equalizes every file into output_dir, pipelined (see RunPipelinedBatch) or with window > 0 as the frames of a video in order
+	//(see RunSlidingWindowBatch). statistics gets a CSV row per image with options.statistics. Returns the number of images written.
+	int EqualizeBatch(const vector<string>& files, const string& output_dir, int window, int threads, bool verbose, ostream* statistics = nullptr) {
+		if (window > 0) { return RunSlidingWindowBatch(Device(), &cpu, files, output_dir, options.bin_size, window, verbose); }
+		return RunPipelinedBatch(Device(), &cpu, Model(), files, output_dir, options, threads, verbose, statistics);
+	}
+
+	//Equalizes the frames on stdin to stdout until the stream ends, see RunStream. Returns the number of frames.
+	int EqualizeStream(const StreamFormat& format, int window, bool verbose) {
+		return RunStream(Device(), &cpu, format, options, window, verbose);
+	}
+
+	//Serves requests on a Unix domain socket until a quit request, see RunDaemon. Returns the number of images equalized.
+	int Serve(const string& socket_path, const string& output_dir, bool verbose) {
+		return RunDaemon(Device(), &cpu, socket_path, output_dir, options, verbose);
+	}
+
+	//bin_size bins for every region of the image in one launch, region r's from r * bin_size
+	vector<unsigned int> RoiHistograms(const CImg<unsigned char>& image, const vector<Roi>& rois) {
+		vector<unsigned int> counts;
+		if (use_device) {
+			cl::Event done;
+			EnqueueRoiHistograms(state, state.queue, buffers, image, rois, options.bin_size, counts, done);
+			done.wait();
+			RanOnDevice(done);
+			return counts;
+		}
+		auto start = std::chrono::steady_clock::now();
+		counts = cpu.RoiHistograms(image, rois, options.bin_size);
+		RanOnCpu(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		return counts;
+	}
+
+	//Fills joint with the joint histogram and mutual information of a and b for each of its shifts, see EnqueueJointHistograms
+	void ComputeJointHistograms(const CImg<unsigned char>& a, const CImg<unsigned char>& b, bool hue_saturation, JointHistograms& joint) {
+		if (use_device) {
+			cl::Event done;
+			EnqueueJointHistograms(state, state.queue, buffers, a, b, hue_saturation, joint, done);
+			done.wait();
+			RanOnDevice(done);
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		JointHistogramsOnHost(cpu, a, b, hue_saturation, joint);
+		RanOnCpu(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	//The slabs a volume goes through the device in, slab_bytes at a time (0 for DefaultSlabBytes). Empty when the volume goes to the
+	//CPU engine.
+	vector<Slab> SlabsOf(const CImg<unsigned char>& volume, size_t slab_bytes) {
+		if (!PrefersDevice(volume.size())) { return {}; }
+		return VolumeSlabs(volume, options, slab_bytes ? slab_bytes : DefaultSlabBytes(state));
+	}
+
+	//Equalizes a volume slab by slab, its histograms stay on the device
+	CImg<unsigned char> EqualizeSlabs(const CImg<unsigned char>& volume, const vector<Slab>& slabs) {
+		return EqualizeVolumeSlabs(state, buffers, volume, options, slabs);
+	}
+
+	//The devices to split images across: every device of the platforms in spec (see ListDevices), or for an empty spec the NUMA nodes
+	//the device was split into
+	DeviceGroup CreateGroup(const string& spec) const {
+		return CreateDeviceGroup(spec.empty() ? state.sub_devices : ListDevices(spec), kernel_file, options);
+	}
+
+	//The statistics of the image the device equalized last, from the histograms still on the device
+	vector<HistogramStatistics> DeviceStatistics(const CImg<unsigned char>& image) {
+		vector<HistogramStatistics> statistics;
+		cl::Event done;
+		EnqueueImageStatistics(state, state.queue, buffers, image, options, statistics, done);
+		done.wait();
+		return statistics;
+	}
+
+	//Channels of the output of a spectrum channel image, one in the backproject mode
+	int OutputChannels(int spectrum) const { return options.mode == "backproject" ? 1 : spectrum; }
+
+	//Whether an image of bytes goes to the device
+	bool PrefersDevice(size_t bytes) const { return use_device && (!use_cost_model || model.PreferDevice(bytes)); }
+
+	bool OnDevice() const { return use_device; }
+	//Why the CPU engine is used although an OpenCL engine was asked for, empty otherwise
+	const string& FallbackReason() const { return fallback_reason; }
+	//Where the last image went, its device event for profiling and its time on the CPU engine
+	bool LastOnDevice() const {
+		lock_guard<mutex> lock(last_guard);
+		return last_on_device;
+	}
+	cl::Event LastEvent() const {
+		lock_guard<mutex> lock(last_guard);
+		return last_event;
+	}
+	double LastHostUs() const {
+		lock_guard<mutex> lock(last_guard);
+		return last_host_us;
+	}
+
+	//NUMA nodes the device was split into, none when it was not
+	int NumaNodes() const { return (int)state.sub_devices.size(); }
+	int CpuThreads() const { return cpu.Threads(); }
+	//What the buffer pool holds and has held, empty on the CPU engine
+	string PoolUsage() const { return use_device ? state.pool->Describe() : string(); }
+	const EqualizeOptions& Options() const { return options; }
+	const CostModel* Model() const { return use_cost_model ? &model : nullptr; }
+
+private:
+	//A queue with buffers of its own for EqualizeAsync
+	struct AsyncSlot {
+		cl::CommandQueue queue;
+		ImageBuffers buffers;
+		cl::Event done;
+	};
+	static const int slot_count = 2;
+
+	DeviceState* Device() { return use_device ? &state : nullptr; }
+
+	void RanOnDevice(const cl::Event& done) {
+		lock_guard<mutex> lock(last_guard);
+		last_event = done;
+		last_on_device = true;
+	}
+
+	void RanOnCpu(double host_us) {
+		lock_guard<mutex> lock(last_guard);
+		last_host_us = host_us;
+		last_on_device = false;
+	}
+
+	//EqualizeAsync's CPU jobs in the order they were queued, until the equalizer goes
+	void RunCpuJobs() {
+		while (true) {
+			packaged_task<void()> job;
+			{
+				unique_lock<mutex> lock(cpu_jobs_guard);
+				cpu_jobs_ready.wait(lock, [&] { return !cpu_jobs.empty() || closing; });
+				if (cpu_jobs.empty()) { return; }
+				job = std::move(cpu_jobs.front());
+				cpu_jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	DeviceState state;
+	bool use_device = false;
+	string fallback_reason;
+	CpuEngine cpu;
+	string kernel_file;
+	thread cpu_worker; //runs the queued CPU jobs of EqualizeAsync, started with the first one
+	mutex cpu_jobs_guard;
+	condition_variable cpu_jobs_ready;
+	deque<packaged_task<void()>> cpu_jobs;
+	bool closing = false;
+	EqualizeOptions options;
+	CostModel model;
+	bool use_cost_model = false;
+	ImageBuffers buffers;
+	DeviceState async_state; //the device with kernel objects of TryEnqueue's own
+	AsyncSlot slots[slot_count];
+	int next_slot = 0;
+	mutex slot_guard; //the slots and async_state's kernel arguments, for TryEnqueue
+	mutable mutex last_guard; //the last_ fields, set by the synchronous and asynchronous calls alike
+	cl::Event last_event;
+	bool last_on_device = false;
+	double last_host_us = 0;
+};
+
+} //namespace histeq
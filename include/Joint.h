@@ -0,0 +1,183 @@
+#pragma once
+
+#include <fstream>
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+
+namespace histeq {
+
+//Joint histograms of two planes for every candidate shift of the second, with the mutual information of each.
+//counts holds binsA x binsB counts per shift, row a (bin of the first plane) then column b.
+struct JointHistograms {
+	int binsA = 0;
+	int binsB = 0;
+	vector<Shift> shifts;
+	vector<unsigned int> counts;
+	vector<float> mutual_information;
+
+	//Shift with the highest mutual information, the best alignment in registration
+	int Best() const { return (int)(max_element(mutual_information.begin(), mutual_information.end()) - mutual_information.begin()); }
+};
+
+//Every shift within radius pixels in x and y, radius 0 is only the unshifted pairing
+inline vector<Shift> ShiftsWithin(int radius) {
+	vector<Shift> shifts;
+	for (int dy = -radius; dy <= radius; dy++) {
+		for (int dx = -radius; dx <= radius; dx++) {
+			Shift shift;
+			shift.dx = dx;
+			shift.dy = dy;
+			shifts.push_back(shift);
+		}
+	}
+	return shifts;
+}
+
+//Parses the bins per axis, "AxB" or a single number for both
+inline bool ParseJointBins(const string& spec, int& binsA, int& binsB) {
+	int fields = sscanf(spec.c_str(), "%dx%d", &binsA, &binsB);
+	if (fields == 1) { binsB = binsA; }
+	return fields >= 1 && binsA > 0 && binsB > 0;
+}
+
+//Shards per candidate of the global fallback, fewer when a single candidate's would not fit in one allocation
+const int joint_shards = 8;
+//Work-groups of the privatized kernel per compute unit, shared out between the candidates
+const int joint_groups_per_unit = 4;
+
+//Enqueues the joint histograms of plane a against plane b for every shift in joint.shifts, then their mutual information.
+//Each candidate's histogram is privatized in local memory when it fits, otherwise it is built in sharded global memory and reduced.
+//With hue_saturation a is an RGB image paired with itself as hue x saturation, b is not used and there should be a single shift.
+//joint.counts and joint.mutual_information are filled once done has completed.
+inline void EnqueueJointHistograms(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& a, const CImg<unsigned char>& b, bool hue_saturation, JointHistograms& joint, cl::Event& done) {
+	int candidates = (int)joint.shifts.size();
+	int jointBins = joint.binsA * joint.binsB;
+	size_t planeSize = (size_t)a.width() * a.height();
+	size_t first_size = hue_saturation ? 3 * planeSize : planeSize;
+	size_t second_size = hue_saturation ? 1 : (size_t)b.width() * b.height();
+	size_t local_bytes = jointBins * sizeof(unsigned int);
+
+	//The kernel's own local memory counts too, its usage includes the local argument once that is set
+	size_t device_local = state.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	cl::Kernel& privatizedKern = state.Kernel("histogramJoint");
+	bool privatized = local_bytes <= device_local;
+	if (privatized) {
+		privatizedKern.setArg(4, cl::Local(local_bytes));
+		privatized = privatizedKern.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(state.device) <= device_local;
+	}
+
+	//The global fallback's shards are run a chunk of candidates at a time, as many as fit in the device's largest allocation
+	size_t max_alloc = state.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	size_t shards = min((size_t)joint_shards, max(max_alloc / (jointBins * sizeof(unsigned int)), (size_t)1));
+	size_t chunk = min((size_t)candidates, max(max_alloc / (jointBins * shards * sizeof(unsigned int)), (size_t)1));
+
+	vector<int> shift_values;
+	for (const Shift& shift : joint.shifts) { shift_values.insert(shift_values.end(), { shift.dx, shift.dy }); }
+
+	buffers.Reserve(state.context, first_size, joint.binsA);
+	buffers.ReserveJoint(state.context, second_size, chunk, candidates, jointBins, privatized ? 0 : shards);
+	queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, first_size, a.data());
+	if (!hue_saturation) { queue.enqueueWriteBuffer(buffers.joint_second, CL_FALSE, 0, second_size, b.data()); }
+	queue.enqueueWriteBuffer(buffers.joint_shifts, CL_TRUE, 0, shift_values.size() * sizeof(int), shift_values.data());
+
+	cl_int4 size = { { a.width(), a.height(), hue_saturation ? a.width() : b.width(), hue_saturation ? a.height() : b.height() } };
+	cl_int4 bins = { { joint.binsA, joint.binsB, a.get_shared_channel(0).max(), hue_saturation ? 0 : b.get_shared_channel(0).max() } };
+
+	if (privatized) {
+		queue.enqueueFillBuffer(buffers.joint_histograms, (cl_uint)0, 0, (size_t)candidates * jointBins * sizeof(unsigned int));
+		cl::Kernel& jointKern = privatizedKern;
+		size_t group = WorkGroupSize(state, jointKern, 256);
+		//Enough work-groups to fill the device, each striding over many pixels so its local histogram is cleared and merged only once
+		size_t units = state.device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		size_t groups = min((units * joint_groups_per_unit + candidates - 1) / max(candidates, 1), RoundUp(planeSize, group) / group);
+		jointKern.setArg(0, buffers.dev_image_input);
+		jointKern.setArg(1, hue_saturation ? buffers.dev_image_input : buffers.joint_second);
+		jointKern.setArg(2, buffers.joint_shifts);
+		jointKern.setArg(3, buffers.joint_histograms);
+		jointKern.setArg(4, cl::Local(local_bytes));
+		jointKern.setArg(5, size);
+		jointKern.setArg(6, bins);
+		jointKern.setArg(7, hue_saturation ? 1 : 0);
+		queue.enqueueNDRangeKernel(jointKern, cl::NullRange, cl::NDRange(groups * group, candidates), cl::NDRange(group, 1));
+	}
+	else {
+		cl::Kernel& jointKern = state.Kernel("histogramJointSharded");
+		size_t group = WorkGroupSize(state, jointKern, 256);
+		jointKern.setArg(0, buffers.dev_image_input);
+		jointKern.setArg(1, hue_saturation ? buffers.dev_image_input : buffers.joint_second);
+		jointKern.setArg(2, buffers.joint_shifts);
+		jointKern.setArg(3, buffers.joint_shards);
+		jointKern.setArg(4, size);
+		jointKern.setArg(5, bins);
+		jointKern.setArg(6, hue_saturation ? 1 : 0);
+		jointKern.setArg(7, (int)shards);
+
+		cl::Kernel& reduceKern = state.Kernel("reduceJointShards");
+		reduceKern.setArg(0, buffers.joint_shards);
+		reduceKern.setArg(1, buffers.joint_histograms);
+		reduceKern.setArg(2, jointBins);
+		reduceKern.setArg(3, (int)shards);
+
+		//The in-order queue runs each chunk's reduction before the next chunk clears the shards
+		for (size_t first = 0; first < (size_t)candidates; first += chunk) {
+			size_t count = min(chunk, candidates - first);
+			queue.enqueueFillBuffer(buffers.joint_shards, (cl_uint)0, 0, count * jointBins * shards * sizeof(unsigned int));
+			jointKern.setArg(8, (int)first);
+			queue.enqueueNDRangeKernel(jointKern, cl::NullRange, cl::NDRange(RoundUp(planeSize, group), count), cl::NDRange(group, 1));
+			reduceKern.setArg(4, (int)first);
+			queue.enqueueNDRangeKernel(reduceKern, cl::NullRange, cl::NDRange(count * jointBins), cl::NullRange);
+		}
+	}
+
+	//The tree reduction needs a power of 2 work-group
+	cl::Kernel& informationKern = state.Kernel("mutualInformation");
+	size_t group = WorkGroupSize(state, informationKern, 256);
+	while (group & (group - 1)) { group &= group - 1; }
+	informationKern.setArg(0, buffers.joint_histograms);
+	informationKern.setArg(1, buffers.joint_information);
+	informationKern.setArg(2, cl::Local((joint.binsA + joint.binsB) * sizeof(unsigned int)));
+	informationKern.setArg(3, cl::Local(group * sizeof(float)));
+	informationKern.setArg(4, joint.binsA);
+	informationKern.setArg(5, joint.binsB);
+	queue.enqueueNDRangeKernel(informationKern, cl::NullRange, cl::NDRange(group * candidates), cl::NDRange(group));
+
+	joint.counts.resize((size_t)candidates * jointBins);
+	joint.mutual_information.resize(candidates);
+	queue.enqueueReadBuffer(buffers.joint_histograms, CL_FALSE, 0, joint.counts.size() * sizeof(unsigned int), joint.counts.data());
+	queue.enqueueReadBuffer(buffers.joint_information, CL_FALSE, 0, candidates * sizeof(float), joint.mutual_information.data(), NULL, &done);
+}
+
+//Same joint histograms and mutual information with the CPU engine
+inline void JointHistogramsOnHost(CpuEngine& cpu, const CImg<unsigned char>& a, const CImg<unsigned char>& b, bool hue_saturation, JointHistograms& joint) {
+	joint.counts = cpu.JointCounts(a, b, joint.shifts, joint.binsA, joint.binsB, hue_saturation);
+	joint.mutual_information.resize(joint.shifts.size());
+	size_t jointBins = (size_t)joint.binsA * joint.binsB;
+	for (size_t c = 0; c < joint.shifts.size(); c++) {
+		joint.mutual_information[c] = (float)CpuEngine::MutualInformation(&joint.counts[c * jointBins], joint.binsA, joint.binsB);
+	}
+}
+
+//Writes the joint histogram of one shift, a .csv file gets one "a,b,frequency" row per joint bin,
+//anything else is binary: binsA and binsB (int32) then the counts (uint32 per bin, row by row)
+inline void WriteJointHistogram(const string& filename, const JointHistograms& joint, int candidate) {
+	const unsigned int* counts = &joint.counts[(size_t)candidate * joint.binsA * joint.binsB];
+	string ext = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	if (ext == ".csv") {
+		ofstream file(filename);
+		file << "a,b,frequency" << endl;
+		for (int a = 0; a < joint.binsA; a++) {
+			for (int b = 0; b < joint.binsB; b++) { file << a << "," << b << "," << counts[a * joint.binsB + b] << endl; }
+		}
+	}
+	else {
+		ofstream file(filename, ios::binary);
+		file.write((const char*)&joint.binsA, sizeof(int));
+		file.write((const char*)&joint.binsB, sizeof(int));
+		file.write((const char*)counts, (size_t)joint.binsA * joint.binsB * sizeof(unsigned int));
+	}
+}
+
+} //namespace histeq
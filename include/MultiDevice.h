@@ -0,0 +1,201 @@
+#pragma once
+
+#include <numeric>
+
+#include "Equalizer.h"
+#include "CostModel.h"
+
+namespace histeq {
+
+//Several OpenCL devices equalizing one image together. Each device has its own context, program and buffers (devices on different
+//platforms cannot share a context) and gets a contiguous run of rows sized by its measured throughput. The partial histograms are merged
+//on the host, the LUT is built once and written to every device, then every device maps its own rows.
+struct DeviceGroup {
+	vector<DeviceState> states;
+	vector<ImageBuffers> buffers;
+	vector<double> bytes_per_us; //measured throughput of each device, the rows are shared out in proportion to it
+};
+
+//Every device of the given platforms, "all" for every platform, otherwise comma separated platform ids
+inline vector<cl::Device> ListDevices(const string& platforms_spec) {
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	vector<int> ids;
+	if (platforms_spec == "all") {
+		for (int i = 0; i < (int)platforms.size(); i++) { ids.push_back(i); }
+	}
+	else {
+		stringstream values(platforms_spec);
+		string value;
+		while (getline(values, value, ',')) {
+			int id = atoi(value.c_str());
+			if (id < 0 || id >= (int)platforms.size()) { throw cl::Error(CL_INVALID_PLATFORM, "ListDevices"); }
+			ids.push_back(id);
+		}
+	}
+
+	vector<cl::Device> devices;
+	for (int id : ids) {
+		vector<cl::Device> platform_devices;
+		platforms[id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &platform_devices);
+		devices.insert(devices.end(), platform_devices.begin(), platform_devices.end());
+	}
+	return devices;
+}
+
+//Splits a device into one sub-device per NUMA node (CPU runtimes on multi-socket hosts), so each node's work stays on its own cores
+//and memory. Returns just the device when the runtime cannot partition it by affinity domain or the host has a single node.
+inline vector<cl::Device> NumaSubDevices(cl::Device device) {
+	vector<cl_device_partition_property> styles = device.getInfo<CL_DEVICE_PARTITION_PROPERTIES>();
+	cl_device_affinity_domain domains = device.getInfo<CL_DEVICE_PARTITION_AFFINITY_DOMAIN>();
+	if (find(styles.begin(), styles.end(), (cl_device_partition_property)CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN) == styles.end() || !(domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA)) {
+		return { device };
+	}
+
+	const cl_device_partition_property numa[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+	vector<cl::Device> nodes;
+	try {
+		device.createSubDevices(numa, &nodes);
+	}
+	catch (const cl::Error&) {
+		//CL_DEVICE_PARTITION_FAILED on a single node host
+		nodes.clear();
+	}
+	if (nodes.size() < 2) { return { device }; }
+	return nodes;
+}
+
+//The device of platform_id/device_id split by NUMA node, one context and program over every node so the batch pipeline can give
+//each node its own slots. The state's own queue and device are the first node's. Unsplit when the device has a single node.
+inline DeviceState CreateNumaDeviceState(int platform_id, int device_id, const string& kernel_file) {
+	cl::Context context = GetContext(platform_id, device_id);
+	if (context() == NULL) { throw cl::Error(CL_DEVICE_NOT_FOUND, "GetContext"); }
+	vector<cl::Device> nodes = NumaSubDevices(context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+	if (nodes.size() < 2) { return CreateDeviceState(context, kernel_file); }
+	DeviceState state = CreateDeviceState(cl::Context(nodes), kernel_file);
+	state.sub_devices = nodes;
+	return state;
+}
+
+//Builds the program for every device and measures each one on its own with the synthetic image size the cost model uses
+inline DeviceGroup CreateDeviceGroup(const vector<cl::Device>& devices, const string& kernel_file, const EqualizeOptions& options) {
+	DeviceGroup group;
+	if (devices.empty()) { throw cl::Error(CL_DEVICE_NOT_FOUND, "CreateDeviceGroup"); }
+	const int repeats = 3;
+	CImg<unsigned char> image(1 << 11, 1 << 11, 1, 1);
+	image.rand(0, 255);
+
+	for (const cl::Device& device : devices) {
+		group.states.push_back(CreateDeviceState(cl::Context({ device }), kernel_file));
+		group.buffers.emplace_back();
+		group.buffers.back().pool = group.states.back().pool.get();
+		cl::Event done;
+		EqualizeImage(group.states.back(), group.buffers.back(), image, options, done);
+		double us = TimeUs([&] {
+			for (int i = 0; i < repeats; i++) { EqualizeImage(group.states.back(), group.buffers.back(), image, options, done); }
+		}) / repeats;
+		group.bytes_per_us.push_back(image.size() / max(us, 1.0));
+	}
+	return group;
+}
+
+//Splits rows into one contiguous run per device in proportion to weights, run d is [bounds[d], bounds[d + 1])
+inline vector<size_t> SplitRows(size_t rows, const vector<double>& weights) {
+	double total = accumulate(weights.begin(), weights.end(), 0.0);
+	vector<size_t> bounds(1, 0);
+	double sum = 0;
+	for (size_t d = 0; d < weights.size(); d++) {
+		sum += weights[d];
+		bounds.push_back(d + 1 == weights.size() ? rows : min(rows, (size_t)(rows * sum / total + 0.5)));
+	}
+	return bounds;
+}
+
+//Global mode split across the group, a row is width pixels of one plane. done gets each device's final read, devices given no rows
+//are left with an empty event. Every device's work has completed when this returns.
+inline CImg<unsigned char> EqualizeMultiDevice(DeviceGroup& group, const CImg<unsigned char>& image_input, const EqualizeOptions& options, vector<cl::Event>& done, Histograms* histograms = nullptr) {
+	int bin_size = options.bin_size;
+	int devices = (int)group.states.size();
+	size_t width = image_input.width();
+	vector<size_t> bounds = SplitRows(image_input.size() / width, group.bytes_per_us);
+	int maximum = image_input.max();
+	vector<vector<unsigned int>> partial(devices, vector<unsigned int>(bin_size));
+	vector<cl::Event> histogramDone(devices);
+	done.assign(devices, cl::Event());
+	auto pixels = [&](int d) { return (int)((bounds[d + 1] - bounds[d]) * width); };
+
+	//Partial histograms, every device at once
+	for (int d = 0; d < devices; d++) {
+		if (pixels(d) == 0) { continue; }
+		DeviceState& state = group.states[d];
+		ImageBuffers& buffers = group.buffers[d];
+		buffers.Reserve(state.context, pixels(d), bin_size);
+		buffers.ReserveChannels(state.context, 1, bin_size);
+		buffers.channel_maximum_values[0] = maximum;
+		state.queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, pixels(d), image_input.data() + bounds[d] * width);
+		state.queue.enqueueWriteBuffer(buffers.channel_maxima, CL_FALSE, 0, sizeof(int), buffers.channel_maximum_values.data());
+		state.queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, bin_size * sizeof(unsigned int));
+
+		cl::Kernel& histogramKern = state.Kernel("histogramChannels");
+		size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+		histogramKern.setArg(0, buffers.dev_image_input);
+		histogramKern.setArg(1, buffers.channel_maxima);
+		histogramKern.setArg(2, buffers.channel_histograms);
+		histogramKern.setArg(3, cl::Local(bin_size * sizeof(unsigned int)));
+		histogramKern.setArg(4, pixels(d));
+		histogramKern.setArg(5, bin_size);
+		state.queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(RoundUp(pixels(d), histogramGroup), 1), cl::NDRange(histogramGroup, 1));
+		state.queue.enqueueReadBuffer(buffers.channel_histograms, CL_FALSE, 0, bin_size * sizeof(unsigned int), partial[d].data(), NULL, &histogramDone[d]);
+		state.queue.flush();
+	}
+
+	//Merge, then scan and normalize as scanChannels does
+	vector<unsigned int> frequency(bin_size, 0);
+	for (int d = 0; d < devices; d++) {
+		if (pixels(d) == 0) { continue; }
+		histogramDone[d].wait();
+		for (int i = 0; i < bin_size; i++) { frequency[i] += partial[d][i]; }
+	}
+	vector<unsigned int> cumulative(bin_size);
+	vector<unsigned char> lut(bin_size);
+	unsigned int total = accumulate(frequency.begin(), frequency.end(), 0u);
+	unsigned int sum = 0;
+	for (int i = 0; i < bin_size; i++) {
+		sum += frequency[i];
+		cumulative[i] = sum;
+		lut[i] = (unsigned char)(int)((sum / (float)total) * maximum);
+	}
+
+	//Broadcast the LUT and map every run of rows
+	CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	for (int d = 0; d < devices; d++) {
+		if (pixels(d) == 0) { continue; }
+		DeviceState& state = group.states[d];
+		ImageBuffers& buffers = group.buffers[d];
+		state.queue.enqueueWriteBuffer(buffers.channel_luts, CL_FALSE, 0, bin_size * sizeof(unsigned char), lut.data());
+
+		cl::Kernel& mapKern = state.Kernel("mapChannels");
+		mapKern.setArg(0, buffers.dev_image_input);
+		mapKern.setArg(1, buffers.channel_luts);
+		mapKern.setArg(2, buffers.channel_maxima);
+		mapKern.setArg(3, buffers.dev_image_output);
+		mapKern.setArg(4, pixels(d));
+		mapKern.setArg(5, bin_size);
+		state.queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(pixels(d)), cl::NullRange);
+		state.queue.enqueueReadBuffer(buffers.dev_image_output, CL_FALSE, 0, pixels(d), output_image.data() + bounds[d] * width, NULL, &done[d]);
+		state.queue.flush();
+	}
+	for (int d = 0; d < devices; d++) {
+		if (pixels(d) > 0) { done[d].wait(); }
+	}
+
+	if (histograms) {
+		histograms->channels = 1;
+		histograms->frequency = frequency;
+		histograms->cumulative = cumulative;
+		histograms->normalized = lut;
+	}
+	return output_image;
+}
+
+} //namespace histeq
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Equalizer.h"
+#include "Statistics.h"
+
+namespace histeq {
+
+//Many small images equalized together: their pixels are packed back to back with an offsets table, and each image
+//is equalized on its own (global mode, its own maximum) in three launches for the whole pack instead of five per image
+struct PackedBatch {
+	vector<unsigned char> pixels;
+	vector<unsigned int> offsets{ 0 };
+	vector<int> maxima;
+	vector<int> groups; //image and first pixel of every work-group's chunk
+	vector<unsigned char> output;
+	vector<HistogramStatistics> statistics; //one record per image, when statistics are on
+	cl::Event statistics_done;
+
+	int Images() const { return (int)maxima.size(); }
+
+	void Add(const CImg<unsigned char>& image) {
+		pixels.insert(pixels.end(), image.data(), image.data() + image.size());
+		offsets.push_back((unsigned int)pixels.size());
+		maxima.push_back(image.max());
+	}
+
+	//Copies image i of the result into output_image, which has the shape of the input image
+	void Extract(int i, const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image) const {
+		output_image.assign(output.data() + offsets[i], image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+	}
+};
+
+//Pixels per work-group chunk of a packed batch
+const int pack_chunk = 4096;
+
+//Enqueues histogramPacked -> scanChannels -> mapPacked for every image of the pack, pack.output is filled once done has completed
+inline void EnqueueEqualizePacked(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, PackedBatch& pack, int bin_size, cl::Event& done) {
+	int images = pack.Images();
+	size_t picture_size = pack.pixels.size();
+
+	//Work-groups are assigned to images by offset, no chunk crosses from one image into the next
+	pack.groups.clear();
+	for (int i = 0; i < images; i++) {
+		for (unsigned int begin = pack.offsets[i]; begin < pack.offsets[i + 1]; begin += pack_chunk) {
+			pack.groups.push_back(i);
+			pack.groups.push_back((int)begin);
+		}
+	}
+	size_t groups = pack.groups.size() / 2;
+
+	buffers.Reserve(state.context, picture_size, bin_size);
+	buffers.ReserveChannels(state.context, images, bin_size);
+	buffers.ReservePack(state.context, images, groups);
+
+	queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, picture_size, pack.pixels.data());
+	queue.enqueueWriteBuffer(buffers.pack_offsets, CL_FALSE, 0, pack.offsets.size() * sizeof(unsigned int), pack.offsets.data());
+	queue.enqueueWriteBuffer(buffers.pack_groups, CL_FALSE, 0, pack.groups.size() * sizeof(int), pack.groups.data());
+	queue.enqueueWriteBuffer(buffers.channel_maxima, CL_FALSE, 0, images * sizeof(int), pack.maxima.data());
+	queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, images * bin_size * sizeof(unsigned int));
+
+	cl::Kernel& histogramKern = state.Kernel("histogramPacked");
+	size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+	histogramKern.setArg(0, buffers.dev_image_input);
+	histogramKern.setArg(1, buffers.pack_offsets);
+	histogramKern.setArg(2, buffers.pack_groups);
+	histogramKern.setArg(3, buffers.channel_maxima);
+	histogramKern.setArg(4, buffers.channel_histograms);
+	histogramKern.setArg(5, cl::Local(bin_size * sizeof(unsigned int)));
+	histogramKern.setArg(6, pack_chunk);
+	histogramKern.setArg(7, bin_size);
+	queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(groups * histogramGroup), cl::NDRange(histogramGroup));
+
+	//One work-group per image, as for the channels of an image
+	cl::Kernel& scanKern = state.Kernel("scanChannels");
+	size_t scanGroup = WorkGroupSize(state, scanKern, 256);
+	scanKern.setArg(0, buffers.channel_histograms);
+	scanKern.setArg(1, buffers.channel_maxima);
+	scanKern.setArg(2, buffers.channel_cumulative);
+	scanKern.setArg(3, buffers.channel_luts);
+	scanKern.setArg(4, cl::Local(2 * scanGroup * sizeof(unsigned int)));
+	scanKern.setArg(5, bin_size);
+	queue.enqueueNDRangeKernel(scanKern, cl::NullRange, cl::NDRange(scanGroup * images), cl::NDRange(scanGroup));
+
+	cl::Kernel& mapKern = state.Kernel("mapPacked");
+	size_t mapGroup = WorkGroupSize(state, mapKern, 256);
+	mapKern.setArg(0, buffers.dev_image_input);
+	mapKern.setArg(1, buffers.pack_offsets);
+	mapKern.setArg(2, buffers.pack_groups);
+	mapKern.setArg(3, buffers.channel_maxima);
+	mapKern.setArg(4, buffers.channel_luts);
+	mapKern.setArg(5, buffers.dev_image_output);
+	mapKern.setArg(6, pack_chunk);
+	mapKern.setArg(7, bin_size);
+	queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(groups * mapGroup), cl::NDRange(mapGroup));
+
+	pack.output.resize(picture_size);
+	queue.enqueueReadBuffer(buffers.dev_image_output, CL_FALSE, 0, picture_size, pack.output.data(), NULL, &done);
+}
+
+} //namespace histeq
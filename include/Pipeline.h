@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+#include "CostModel.h"
+#include "Batch.h"
+#include "Pack.h"
+#include "Statistics.h"
+
+namespace histeq {
+
+//Bounded queue handing work between the stages of the pipeline, Push blocks while the queue is full
+template <typename T>
+class BlockingQueue {
+public:
+	explicit BlockingQueue(size_t capacity) : capacity(capacity) {}
+
+	//Returns false if the queue was closed, the item is then dropped
+	bool Push(T item) {
+		unique_lock<mutex> lock(m);
+		notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+		if (closed) { return false; }
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	//Returns false once the queue has been closed and emptied
+	bool Pop(T& item) {
+		unique_lock<mutex> lock(m);
+		notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+		if (items.empty()) { return false; }
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void Close() {
+		lock_guard<mutex> lock(m);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed = false;
+	deque<T> items;
+	mutex m;
+	condition_variable notEmpty;
+	condition_variable notFull;
+};
+
+//One image moving through the pipeline
+struct BatchItem {
+	string file;
+	CImg<unsigned char> image;
+	CImg<unsigned char> output;
+	cl::Event done;
+	double host_us = -1; //set instead of done when the CPU engine processed the image
+	string route; //why the image went to the engine it did, when a cost model decided
+	vector<HistogramStatistics> statistics;
+	cl::Event statistics_done; //set when the statistics were computed on the device
+};
+
+//A command queue with its own buffers, images alternate between the slots so one uploads while the other computes
+struct PipelineSlot {
+	cl::CommandQueue queue;
+	ImageBuffers buffers;
+	vector<unique_ptr<BatchItem>> items; //one image, or every image of a pack
+	bool packed = false;
+	PackedBatch pack;
+};
+
+//Pipelined batch: decode thread pool -> two in-order command queues -> encode thread pool.
+//Image N+1 is uploading while N is computing and N-1 is being written, so throughput is set by the slowest stage.
+//A device split by NUMA node gets two slots per node, each slot's queue runs on one node and consecutive images go to different nodes.
+//Images go to the CPU engine instead when there is no device state, or when the cost model says it is faster.
+//With packing on (global mode) small images skip the cost model and are gathered into packs that go through the device together.
+//With options.statistics each image's statistics are written to statistics as CSV rows.
+//Returns the number of images written.
+inline int RunPipelinedBatch(DeviceState* state, CpuEngine* cpu, const CostModel* model, const vector<string>& files, const string& output_dir, const EqualizeOptions& options, int threads, bool verbose, ostream* statistics = nullptr) {
+	int nodes = state ? max((int)state->sub_devices.size(), 1) : 1;
+	const int slot_count = 2 * nodes;
+
+	BlockingQueue<unique_ptr<BatchItem>> decoded(threads + slot_count);
+	BlockingQueue<unique_ptr<BatchItem>> finished(threads + slot_count);
+	atomic<size_t> next_file(0);
+	atomic<int> decoders_running(threads);
+	atomic<int> processed(0);
+	mutex report;
+
+	//Decode stage
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			for (size_t i = next_file++; i < files.size(); i = next_file++) {
+				unique_ptr<BatchItem> item(new BatchItem());
+				item->file = files[i];
+				try {
+					item->image = LoadImage8(item->file);
+				}
+				catch (CImgException& err) {
+					lock_guard<mutex> lock(report);
+					std::cerr << "ERROR: " << item->file << ": " << err._message << std::endl;
+					continue;
+				}
+				if (!decoded.Push(std::move(item))) { break; }
+			}
+			if (--decoders_running == 0) { decoded.Close(); }
+		});
+	}
+
+	//Encode stage
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			unique_ptr<BatchItem> item;
+			while (finished.Pop(item)) {
+				string output_filename = BatchOutputName(output_dir, item->file);
+				try {
+					item->output.save(output_filename.c_str());
+					processed++;
+				}
+				catch (CImgException& err) {
+					lock_guard<mutex> lock(report);
+					std::cerr << "ERROR: " << output_filename << ": " << err._message << std::endl;
+					continue;
+				}
+				if (statistics && options.statistics) {
+					lock_guard<mutex> lock(report);
+					WriteStatisticsRows(*statistics, item->file, item->statistics, options.percentiles);
+				}
+				if (verbose) {
+					lock_guard<mutex> lock(report);
+					std::cout << item->file << " -> " << output_filename << " (" << item->image.width() << "x" << item->image.height() << "x" << item->image.spectrum() << "), ";
+					if (!item->route.empty()) { std::cout << item->route << ", "; }
+					if (item->host_us >= 0) { std::cout << "CPU " << item->host_us << " [us]" << std::endl; }
+					else { std::cout << GetFullProfilingInfo(item->done, ProfilingResolution::PROF_US) << std::endl; }
+				}
+			}
+		});
+	}
+
+	//Compute stage, runs on this thread so only one thread ever touches the kernels
+	vector<PipelineSlot> slots(slot_count);
+
+	//Hands a slot's finished images on to the encoders, freeing the slot for the next image or pack
+	auto retire = [&](PipelineSlot& slot) {
+		if (slot.items.empty()) { return; }
+		slot.items.front()->done.wait();
+		if (slot.packed && slot.pack.statistics_done()) { slot.pack.statistics_done.wait(); }
+		for (size_t i = 0; i < slot.items.size(); i++) {
+			BatchItem& retired = *slot.items[i];
+			if (retired.statistics_done()) { retired.statistics_done.wait(); }
+			if (slot.packed) {
+				slot.pack.Extract((int)i, retired.image, retired.output);
+				if (options.statistics) { retired.statistics.assign(1, slot.pack.statistics[i]); }
+			}
+			finished.Push(std::move(slot.items[i]));
+		}
+		slot.items.clear();
+	};
+
+	bool packing = state && options.pack_images > 1 && options.mode == "global";
+	vector<unique_ptr<BatchItem>> pending; //small images waiting for their pack to fill
+	int n = 0;
+
+	//Sends the pending images through the next slot as one pack, they all share the pack's event
+	auto dispatch_pack = [&]() {
+		if (pending.empty()) { return; }
+		PipelineSlot& slot = slots[n++ % slot_count];
+		retire(slot);
+		slot.items = std::move(pending);
+		pending.clear();
+		slot.packed = true;
+		slot.pack = PackedBatch();
+		string route = "pack of " + to_string(slot.items.size());
+		for (unique_ptr<BatchItem>& packed_item : slot.items) {
+			slot.pack.Add(packed_item->image);
+			packed_item->route = route;
+		}
+		EnqueueEqualizePacked(*state, slot.queue, slot.buffers, slot.pack, options.bin_size, slot.items.front()->done);
+		if (options.statistics) {
+			EnqueueStatistics(*state, slot.queue, slot.buffers, slot.buffers.channel_cumulative, slot.buffers.channel_maxima, slot.pack.Images(), options.bin_size, options.percentiles, slot.pack.statistics, slot.pack.statistics_done);
+		}
+		for (unique_ptr<BatchItem>& packed_item : slot.items) { packed_item->done = slot.items.front()->done; }
+		slot.queue.flush();
+	};
+
+	try {
+		for (int s = 0; s < slot_count && state; s++) {
+			//A slot's buffers are only ever touched by its own node's queue
+			const cl::Device& device = state->sub_devices.empty() ? state->device : state->sub_devices[s % nodes];
+			slots[s].queue = cl::CommandQueue(state->context, device, CL_QUEUE_PROFILING_ENABLE);
+			slots[s].buffers.pool = state->pool.get();
+			slots[s].buffers.device = device();
+		}
+
+		unique_ptr<BatchItem> item;
+		while (decoded.Pop(item)) {
+			if (packing && item->image.size() <= options.pack_max_bytes) {
+				pending.push_back(std::move(item));
+				if ((int)pending.size() >= options.pack_images) { dispatch_pack(); }
+				continue;
+			}
+			if (state && model) { item->route = model->Describe(item->image.size()); }
+			if (!state || (model && !model->PreferDevice(item->image.size()))) {
+				//The CPU engine already spreads each image over its own thread pool
+				auto start = std::chrono::steady_clock::now();
+				Histograms histograms;
+				item->output = cpu->Equalize(item->image, options, options.statistics ? &histograms : nullptr);
+				if (options.statistics) { item->statistics = ImageStatisticsOnHost(item->image, options, histograms); }
+				item->host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+				finished.Push(std::move(item));
+				continue;
+			}
+
+			PipelineSlot& slot = slots[n++ % slot_count];
+			retire(slot);
+			slot.items.push_back(std::move(item));
+			slot.packed = false;
+			BatchItem& current = *slot.items.front();
+			EnqueueEqualize(*state, slot.queue, slot.buffers, current.image, current.output, options, current.done);
+			if (options.statistics) { EnqueueImageStatistics(*state, slot.queue, slot.buffers, current.image, options, current.statistics, current.statistics_done); }
+			slot.queue.flush();
+		}
+		dispatch_pack();
+		for (PipelineSlot& slot : slots) {
+			retire(slot);
+			if (state) {
+				slot.queue.finish();
+				slot.buffers.ReleaseToPool();
+			}
+		}
+	}
+	catch (...) {
+		//Stop the other stages before letting the error through. The other slots may still be reading into their images' outputs,
+		//which go with the slots, so their queues are drained first (a failed queue only reports the error again).
+		for (PipelineSlot& slot : slots) {
+			if (!slot.queue()) { continue; }
+			try { slot.queue.finish(); }
+			catch (...) {}
+		}
+		decoded.Close();
+		finished.Close();
+		for (thread& worker : workers) { worker.join(); }
+		throw;
+	}
+
+	finished.Close();
+	for (thread& worker : workers) { worker.join(); }
+	return processed;
+}
+
+} //namespace histeq
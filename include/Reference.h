@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+
+namespace histeq {
+
+//Builds the reference CDF for the match mode with whichever engine is in use and uploads it once when there is a device,
+//so every image of a run, or of a whole batch, only has to compute its own CDF
+inline shared_ptr<const ReferenceHistogram> LoadReferenceHistogram(const string& filename, DeviceState* state, CpuEngine& cpu, const EqualizeOptions& options) {
+	CImg<unsigned char> image = LoadImage8(filename);
+
+	//The reference is binned exactly as the images will be, Hillis-Steele works for any bin count
+	EqualizeOptions global = options;
+	global.mode = "global";
+	global.scanKernel = "scan_hs";
+	global.reference = nullptr;
+
+	Histograms histograms;
+	if (state) {
+		ImageBuffers buffers;
+		cl::Event done;
+		EqualizeImage(*state, buffers, image, global, done, &histograms);
+	}
+	else {
+		cpu.Equalize(image, global, &histograms);
+	}
+
+	shared_ptr<ReferenceHistogram> reference = make_shared<ReferenceHistogram>();
+	reference->maximum = image.max();
+	reference->cdf = histograms.cumulative;
+	if (state) {
+		reference->buffer = cl::Buffer(state->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, reference->cdf.size() * sizeof(unsigned int), reference->cdf.data());
+	}
+	return reference;
+}
+
+} //namespace histeq
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+
+#include "Equalizer.h"
+
+namespace histeq {
+
+//Reads regions of interest from a text file, one "x y width height" per line, commas also separate, # starts a comment.
+//Regions are clipped to the image, whatever is left outside it is not counted.
+inline vector<Roi> LoadRois(const string& filename, int width, int height) {
+	ifstream file(filename);
+	if (!file) { throw CImgIOException("cannot open region file '%s'", filename.c_str()); }
+	vector<Roi> rois;
+	string line;
+	while (getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		replace(line.begin(), line.end(), ',', ' ');
+		stringstream values(line);
+		Roi roi;
+		if (!(values >> roi.x >> roi.y >> roi.width >> roi.height)) { continue; }
+		int x1 = min(roi.x + roi.width, width);
+		int y1 = min(roi.y + roi.height, height);
+		roi.x = max(roi.x, 0);
+		roi.y = max(roi.y, 0);
+		roi.width = max(x1 - roi.x, 0);
+		roi.height = max(y1 - roi.y, 0);
+		rois.push_back(roi);
+	}
+	return rois;
+}
+
+//Enqueues the histograms of every region in a single launch over a 3D NDRange (x, y, region) reading the full frame in place,
+//so nothing is cropped on the host. counts receives one run of bin_size counts per region once done has completed.
+inline void EnqueueRoiHistograms(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image, const vector<Roi>& rois, int bin_size, vector<unsigned int>& counts, cl::Event& done) {
+	size_t picture_size = image.size() * sizeof(unsigned char);
+	size_t histograms_size = rois.size() * bin_size * sizeof(unsigned int);
+	buffers.Reserve(state.context, picture_size, bin_size);
+	buffers.ReserveChannels(state.context, (int)rois.size(), bin_size);
+	buffers.ReserveRois(state.context, rois.size());
+
+	int widest = 1;
+	int tallest = 1;
+	buffers.roi_values.clear();
+	for (const Roi& roi : rois) {
+		buffers.roi_values.insert(buffers.roi_values.end(), { roi.x, roi.y, roi.width, roi.height });
+		widest = max(widest, roi.width);
+		tallest = max(tallest, roi.height);
+	}
+
+	queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, picture_size, image.data());
+	queue.enqueueWriteBuffer(buffers.roi_list, CL_FALSE, 0, buffers.roi_values.size() * sizeof(int), buffers.roi_values.data());
+	queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, histograms_size);
+
+	cl::Kernel& roiKern = state.Kernel("histogramRois");
+	roiKern.setArg(0, buffers.dev_image_input);
+	roiKern.setArg(1, buffers.roi_list);
+	roiKern.setArg(2, buffers.channel_histograms);
+	roiKern.setArg(3, cl::Local(bin_size * sizeof(unsigned int)));
+	roiKern.setArg(4, image.width());
+	roiKern.setArg(5, image.width() * image.height());
+	roiKern.setArg(6, image.spectrum());
+	roiKern.setArg(7, bin_size);
+	roiKern.setArg(8, (int)image.max());
+
+	//16x16 work-groups, enough of them to cover the largest region up to 256x256, larger regions are looped over
+	const size_t group = 16;
+	size_t range_x = min(RoundUp(widest, group), (size_t)256);
+	size_t range_y = min(RoundUp(tallest, group), (size_t)256);
+	queue.enqueueNDRangeKernel(roiKern, cl::NullRange, cl::NDRange(range_x, range_y, rois.size()), cl::NDRange(group, group, 1));
+
+	counts.resize(rois.size() * bin_size);
+	queue.enqueueReadBuffer(buffers.channel_histograms, CL_FALSE, 0, histograms_size, counts.data(), NULL, &done);
+}
+
+//Writes region histograms, a .csv file gets one "roi,x,y,width,height,bin,frequency" row per bin of every region,
+//anything else is binary: the region count and bin count (int32) then the counts (uint32 per bin, region after region)
+inline void WriteRoiHistograms(const string& filename, const vector<Roi>& rois, int bin_size, const vector<unsigned int>& counts) {
+	string ext = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	if (ext == ".csv") {
+		ofstream file(filename);
+		file << "roi,x,y,width,height,bin,frequency" << endl;
+		for (size_t r = 0; r < rois.size(); r++) {
+			for (int i = 0; i < bin_size; i++) {
+				file << r << "," << rois[r].x << "," << rois[r].y << "," << rois[r].width << "," << rois[r].height << "," << i << "," << counts[r * bin_size + i] << endl;
+			}
+		}
+	}
+	else {
+		ofstream file(filename, ios::binary);
+		int count = (int)rois.size();
+		file.write((const char*)&count, sizeof(int));
+		file.write((const char*)&bin_size, sizeof(int));
+		file.write((const char*)counts.data(), counts.size() * sizeof(unsigned int));
+	}
+}
+
+} //namespace histeq
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <sstream>
+
+#include "Equalizer.h"
+
+namespace histeq {
+
+//Statistics of one histogram, same layout as Statistics in my_kernels.cl so a whole record is read back in one go.
+//Values are pixel intensities, bin i standing for i * maximum / (bin_size - 1).
+struct HistogramStatistics {
+	unsigned int count;
+	float mean;
+	float variance;
+	float entropy; //Shannon entropy in bits
+	float median;
+	float otsu; //Otsu's threshold, bins up to it are the background class
+	float percentiles[8];
+};
+
+//Parses a comma separated list of percentiles (e.g. 1,5,95,99.5) into hundredths of a percent
+inline bool ParsePercentiles(const string& spec, vector<int>& percentiles) {
+	percentiles.clear();
+	stringstream values(spec);
+	string value;
+	while (getline(values, value, ',')) {
+		float p = (float)atof(value.c_str());
+		if (p < 0 || p > 100) { return false; }
+		percentiles.push_back((int)(p * 100 + 0.5f));
+	}
+	return !percentiles.empty() && percentiles.size() <= 8;
+}
+
+//Enqueues the statistics of histograms cumulative histograms of bin_size bins, each with its own maximum in maxima.
+//statistics receives one record per histogram once done has completed, the histograms themselves never leave the device.
+inline void EnqueueStatistics(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, cl::Buffer& cumulative, cl::Buffer& maxima, int histograms, int bin_size, const vector<int>& percentiles, vector<HistogramStatistics>& statistics, cl::Event& done) {
+	buffers.ReserveStatistics(state.context, histograms, sizeof(HistogramStatistics));
+	queue.enqueueWriteBuffer(buffers.statistics_percentiles, CL_FALSE, 0, percentiles.size() * sizeof(int), percentiles.data());
+
+	//The reductions need a power of 2 work-group
+	cl::Kernel& statisticsKern = state.Kernel("histogramStatistics");
+	size_t group = WorkGroupSize(state, statisticsKern, 256);
+	while (group & (group - 1)) { group &= group - 1; }
+	statisticsKern.setArg(0, cumulative);
+	statisticsKern.setArg(1, maxima);
+	statisticsKern.setArg(2, buffers.statistics_records);
+	statisticsKern.setArg(3, cl::Local(2 * group * sizeof(float)));
+	statisticsKern.setArg(4, buffers.statistics_percentiles);
+	statisticsKern.setArg(5, (int)percentiles.size());
+	statisticsKern.setArg(6, bin_size);
+	queue.enqueueNDRangeKernel(statisticsKern, cl::NullRange, cl::NDRange(group * histograms), cl::NDRange(group));
+
+	statistics.resize(histograms);
+	queue.enqueueReadBuffer(buffers.statistics_records, CL_FALSE, 0, histograms * sizeof(HistogramStatistics), statistics.data(), NULL, &done);
+}
+
+//Statistics of the histograms an EnqueueEqualize call left on the device, one record per channel in the channel mode, per slice in the slice mode, otherwise one
+inline void EnqueueImageStatistics(DeviceState& state, cl::CommandQueue& queue, ImageBuffers& buffers, const CImg<unsigned char>& image_input, const EqualizeOptions& options, vector<HistogramStatistics>& statistics, cl::Event& done) {
+	bool perChannel = options.mode == "channel" || options.mode == "slice";
+	EnqueueStatistics(state, queue, buffers, perChannel ? buffers.channel_cumulative : CumulativeBuffer(buffers, options.scanKernel), perChannel ? buffers.channel_maxima : buffers.maximumValue,
+		HistogramPlanes(image_input, options.mode), options.bin_size, options.percentiles, statistics, done);
+}
+
+//Same statistics on the host from a cumulative histogram, summed in the same order as histogramStatistics with one work-item
+inline HistogramStatistics StatisticsOnHost(const unsigned int* cum, int bin_size, int maximum, const vector<int>& percentiles) {
+	HistogramStatistics statistics = {};
+	unsigned int total = cum[bin_size - 1];
+	float scale = bin_size > 1 ? maximum / (float)(bin_size - 1) : 0;
+	auto frequency = [&](int i) { return cum[i] - (i > 0 ? cum[i - 1] : 0); };
+
+	float sum = 0;
+	float entropy = 0;
+	for (int i = 0; i < bin_size; i++) {
+		unsigned int f = frequency(i);
+		sum += f * (i * scale);
+		if (f > 0) {
+			float p = f / (float)total;
+			entropy -= p * log2(p);
+		}
+	}
+	float mean = total > 0 ? sum / total : 0;
+	float squares = 0;
+	for (int i = 0; i < bin_size; i++) {
+		float d = i * scale - mean;
+		squares += frequency(i) * d * d;
+	}
+	statistics.count = total;
+	statistics.mean = mean;
+	statistics.variance = total > 0 ? squares / total : 0;
+	statistics.entropy = entropy;
+
+	auto first_reaching = [&](int permyriad) {
+		int i = 0;
+		while (i < bin_size - 1 && (unsigned long long)cum[i] * 10000 < (unsigned long long)permyriad * total) { i++; }
+		return i * scale;
+	};
+	for (size_t p = 0; p < percentiles.size(); p++) { statistics.percentiles[p] = first_reaching(percentiles[p]); }
+	statistics.median = first_reaching(5000);
+
+	unsigned long long weighted = 0;
+	for (int i = 0; i < bin_size; i++) { weighted += (unsigned long long)i * frequency(i); }
+	float meanBin = weighted / (float)total;
+	unsigned long long below = 0;
+	float best = -1;
+	int threshold = 0;
+	for (int t = 0; t < bin_size; t++) {
+		below += (unsigned long long)t * frequency(t);
+		if (cum[t] == 0 || cum[t] == total) { continue; }
+		float w = cum[t] / (float)total;
+		float d = meanBin * w - below / (float)total;
+		float between = d * d / (w * (1 - w));
+		if (between > best) {
+			best = between;
+			threshold = t;
+		}
+	}
+	statistics.otsu = threshold * scale;
+	return statistics;
+}
+
+//Statistics from the histograms the CPU engine returned for an image
+inline vector<HistogramStatistics> ImageStatisticsOnHost(const CImg<unsigned char>& image_input, const EqualizeOptions& options, const Histograms& histograms) {
+	vector<HistogramStatistics> statistics;
+	bool perChannel = options.mode == "channel" || options.mode == "slice";
+	for (int c = 0; c < histograms.channels; c++) {
+		int maximum = perChannel ? PlaneMaximum(image_input, histograms.channels, c) : image_input.max();
+		statistics.push_back(StatisticsOnHost(&histograms.cumulative[(size_t)c * options.bin_size], options.bin_size, maximum, options.percentiles));
+	}
+	return statistics;
+}
+
+//Statistics are written as CSV, one "file,channel,count,mean,variance,entropy,median,otsu,p..." row per histogram
+inline void WriteStatisticsHeader(ostream& out, const vector<int>& percentiles) {
+	out << "file,channel,count,mean,variance,entropy,median,otsu";
+	for (int p : percentiles) { out << ",p" << p / 100.0; }
+	out << endl;
+}
+
+inline void WriteStatisticsRows(ostream& out, const string& file, const vector<HistogramStatistics>& statistics, const vector<int>& percentiles) {
+	for (size_t c = 0; c < statistics.size(); c++) {
+		const HistogramStatistics& s = statistics[c];
+		out << file << "," << c << "," << s.count << "," << s.mean << "," << s.variance << "," << s.entropy << "," << s.median << "," << s.otsu;
+		for (size_t p = 0; p < percentiles.size(); p++) { out << "," << s.percentiles[p]; }
+		out << endl;
+	}
+}
+
+} //namespace histeq
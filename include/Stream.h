@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+#include "Pipeline.h"
+#include "Video.h"
+
+namespace histeq {
+
+//Format of a frame stream on stdin, either concatenated PNM frames or raw frames of a fixed size.
+//Raw frames are interleaved (e.g. RGBRGB...), one or two bytes per sample, two byte samples little endian.
+struct StreamFormat {
+	bool pnm = false;
+	int width = 0;
+	int height = 0;
+	int channels = 1;
+	int bytes_per_sample = 1;
+
+	size_t FrameBytes() const { return (size_t)width * height * channels * bytes_per_sample; }
+};
+
+//Parses "pnm", "WxHxC" or "WxHxCx16"
+inline bool ParseStreamFormat(const string& spec, StreamFormat& format) {
+	if (spec == "pnm") {
+		format.pnm = true;
+		return true;
+	}
+	int bits = 8;
+	int fields = sscanf(spec.c_str(), "%dx%dx%dx%d", &format.width, &format.height, &format.channels, &bits);
+	format.bytes_per_sample = bits > 8 ? 2 : 1;
+	return fields >= 3 && format.width > 0 && format.height > 0 && format.channels > 0;
+}
+
+//A frame moving through the stream, the pixels live in pinned (CL_MEM_ALLOC_HOST_PTR) memory when there is a device
+//so the transfers to and from the device go straight from the staging memory
+struct StreamFrame {
+	cl::Buffer pinned_input;
+	cl::Buffer pinned_output;
+	CImg<unsigned char> input; //views of the mapped pinned memory, or ordinary images without a device
+	CImg<unsigned char> output;
+	cl::Event done;
+	double host_us = -1;
+	int index = 0;
+};
+
+//Reads the next frame into frame.input, returns false at the end of the stream
+inline bool ReadStreamFrame(FILE* in, const StreamFormat& format, StreamFrame& frame, vector<unsigned char>& raw) {
+	int c = fgetc(in);
+	if (c == EOF) { return false; }
+	ungetc(c, in);
+
+	if (format.pnm) {
+		CImg<unsigned short> img0;
+		img0.load_pnm(in);
+		CImg<unsigned char> img = img0 / (img0.max() > 255 ? 257 : 1);
+		if (!img.is_sameXYZC(frame.input)) { throw CImgIOException("frame %d is %dx%dx%d, the stream started with %dx%dx%d", frame.index, img.width(), img.height(), img.spectrum(), frame.input.width(), frame.input.height(), frame.input.spectrum()); }
+		memcpy(frame.input.data(), img.data(), img.size());
+		return true;
+	}
+
+	size_t frame_bytes = format.FrameBytes();
+	raw.resize(frame_bytes);
+	size_t read = fread(raw.data(), 1, frame_bytes, in);
+	if (read < frame_bytes) {
+		if (read > 0) { std::cerr << "ERROR: stream ended part way through frame " << frame.index << std::endl; }
+		return false;
+	}
+
+	//Interleaved samples to CImg's planar layout
+	size_t plane = (size_t)format.width * format.height;
+	unsigned char* pixels = frame.input.data();
+	for (int ch = 0; ch < format.channels; ch++) {
+		for (size_t i = 0; i < plane; i++) {
+			size_t sample = i * format.channels + ch;
+			pixels[ch * plane + i] = format.bytes_per_sample == 2 ? (unsigned char)((raw[2 * sample] | (raw[2 * sample + 1] << 8)) / 257) : raw[sample];
+		}
+	}
+	return true;
+}
+
+//Writes frame.output in the stream's format, raw streams get back the bit depth they came in with, PNM streams are written 8 bit.
+//The output may have fewer channels than the input (backproject mode).
+inline void WriteStreamFrame(FILE* out, const StreamFormat& format, const StreamFrame& frame, vector<unsigned char>& raw) {
+	if (format.pnm) {
+		frame.output.save_pnm(out);
+		fflush(out);
+		return;
+	}
+
+	size_t plane = (size_t)format.width * format.height;
+	int channels = frame.output.spectrum();
+	const unsigned char* pixels = frame.output.data();
+	raw.resize(plane * channels * format.bytes_per_sample);
+	for (int ch = 0; ch < channels; ch++) {
+		for (size_t i = 0; i < plane; i++) {
+			size_t sample = i * channels + ch;
+			if (format.bytes_per_sample == 2) {
+				unsigned int v = pixels[ch * plane + i] * 257;
+				raw[2 * sample] = (unsigned char)(v & 0xFF);
+				raw[2 * sample + 1] = (unsigned char)(v >> 8);
+			}
+			else {
+				raw[sample] = pixels[ch * plane + i];
+			}
+		}
+	}
+	fwrite(raw.data(), 1, raw.size(), out);
+	fflush(out);
+}
+
+//Streams frames from stdin to stdout: reader thread -> two in-order command queues -> writer thread.
+//Frames are staged in pinned memory and alternate between the queues, so one frame uploads while the previous one computes and
+//the one before that downloads. With a window the frames are equalized in order through SlidingWindowEqualizer instead.
+//Returns the number of frames written.
+inline int RunStream(DeviceState* state, CpuEngine* cpu, const StreamFormat& stream_format, const EqualizeOptions& options, int window, bool verbose) {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	StreamFormat format = stream_format;
+	const int slot_count = 2;
+	const int frame_count = slot_count + 2; //frames in flight: one being read, one per slot and one being written
+	vector<unsigned char> read_raw;
+
+	//The first PNM frame gives the size of every staging buffer
+	CImg<unsigned char> first;
+	if (format.pnm) {
+		int c = fgetc(stdin);
+		if (c == EOF) { return 0; }
+		ungetc(c, stdin);
+		CImg<unsigned short> img0;
+		img0.load_pnm(stdin);
+		first = img0 / (img0.max() > 255 ? 257 : 1);
+		format.width = first.width();
+		format.height = first.height();
+		format.channels = first.spectrum();
+	}
+
+	vector<unique_ptr<StreamFrame>> frames(frame_count);
+	size_t frame_bytes = (size_t)format.width * format.height * format.channels;
+	int output_channels = options.mode == "backproject" ? 1 : format.channels;
+	size_t output_bytes = (size_t)format.width * format.height * output_channels;
+	for (unique_ptr<StreamFrame>& frame : frames) {
+		frame.reset(new StreamFrame());
+		if (state) {
+			frame->pinned_input = state->pool->Acquire(state->context, NULL, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, frame_bytes);
+			frame->pinned_output = state->pool->Acquire(state->context, NULL, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, output_bytes);
+			unsigned char* in = (unsigned char*)state->queue.enqueueMapBuffer(frame->pinned_input, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, frame_bytes);
+			unsigned char* out = (unsigned char*)state->queue.enqueueMapBuffer(frame->pinned_output, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, output_bytes);
+			frame->input.assign(in, format.width, format.height, 1, format.channels, true);
+			frame->output.assign(out, format.width, format.height, 1, output_channels, true);
+		}
+		else {
+			frame->input.assign(format.width, format.height, 1, format.channels);
+			frame->output.assign(format.width, format.height, 1, output_channels);
+		}
+	}
+
+	BlockingQueue<StreamFrame*> free_frames(frame_count);
+	BlockingQueue<StreamFrame*> read_frames(frame_count);
+	BlockingQueue<StreamFrame*> finished(frame_count);
+	for (unique_ptr<StreamFrame>& frame : frames) { free_frames.Push(frame.get()); }
+	atomic<int> written(0);
+
+	//Reader
+	thread reader([&] {
+		StreamFrame* frame;
+		for (int index = 0; free_frames.Pop(frame); index++) {
+			frame->index = index;
+			bool more = false;
+			try {
+				if (index == 0 && format.pnm) {
+					memcpy(frame->input.data(), first.data(), first.size());
+					more = true;
+				}
+				else {
+					more = ReadStreamFrame(stdin, format, *frame, read_raw);
+				}
+			}
+			catch (CImgException& err) {
+				std::cerr << "ERROR: " << err._message << std::endl;
+			}
+			if (!more || !read_frames.Push(frame)) { break; }
+		}
+		read_frames.Close();
+	});
+
+	//Writer, frames arrive in order
+	thread writer([&] {
+		vector<unsigned char> write_raw;
+		StreamFrame* frame;
+		while (finished.Pop(frame)) {
+			WriteStreamFrame(stdout, format, *frame, write_raw);
+			written++;
+			if (verbose) {
+				std::cerr << "frame " << frame->index << ", ";
+				if (frame->host_us >= 0) { std::cerr << "CPU " << frame->host_us << " [us]" << std::endl; }
+				else { std::cerr << GetFullProfilingInfo(frame->done, ProfilingResolution::PROF_US) << std::endl; }
+			}
+			free_frames.Push(frame);
+		}
+	});
+
+	//Compute, on this thread
+	vector<PipelineSlot> slots(slot_count);
+	unique_ptr<SlidingWindowEqualizer> windowed;
+	if (window > 0) { windowed.reset(new SlidingWindowEqualizer(state, cpu, options.bin_size, window)); }
+	vector<StreamFrame*> in_flight(slot_count, nullptr);
+	try {
+		for (PipelineSlot& slot : slots) {
+			if (state) {
+				slot.queue = cl::CommandQueue(state->context, state->device, CL_QUEUE_PROFILING_ENABLE);
+				slot.buffers.pool = state->pool.get();
+			}
+		}
+
+		StreamFrame* frame;
+		int n = 0;
+		for (; read_frames.Pop(frame); n++) {
+			if (!state || windowed) {
+				auto start = std::chrono::steady_clock::now();
+				CImg<unsigned char> result = windowed ? windowed->Equalize(frame->input, frame->done) : cpu->Equalize(frame->input, options);
+				memcpy(frame->output.data(), result.data(), result.size());
+				if (!state) { frame->host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count(); }
+				finished.Push(frame);
+				continue;
+			}
+
+			//Hand the slot's previous frame on to the writer before reusing it, frames are retired in the order they arrived
+			int s = n % slot_count;
+			if (in_flight[s]) {
+				in_flight[s]->done.wait();
+				finished.Push(in_flight[s]);
+			}
+			in_flight[s] = frame;
+			EnqueueEqualize(*state, slots[s].queue, slots[s].buffers, frame->input, frame->output, options, frame->done);
+			slots[s].queue.flush();
+		}
+		for (int i = 0; i < slot_count; i++) {
+			StreamFrame*& last = in_flight[(n + i) % slot_count];
+			if (last) {
+				last->done.wait();
+				finished.Push(last);
+				last = nullptr;
+			}
+		}
+	}
+	catch (...) {
+		free_frames.Close();
+		read_frames.Close();
+		finished.Close();
+		reader.join();
+		writer.join();
+		throw;
+	}
+
+	finished.Close();
+	writer.join();
+	free_frames.Close();
+	reader.join();
+
+	if (state) {
+		for (unique_ptr<StreamFrame>& frame : frames) {
+			state->queue.enqueueUnmapMemObject(frame->pinned_input, frame->input.data());
+			state->queue.enqueueUnmapMemObject(frame->pinned_output, frame->output.data());
+		}
+		state->queue.finish();
+		for (PipelineSlot& slot : slots) {
+			slot.queue.finish();
+			slot.buffers.ReleaseToPool();
+		}
+		for (unique_ptr<StreamFrame>& frame : frames) {
+			state->pool->Release(frame->pinned_input);
+			state->pool->Release(frame->pinned_output);
+		}
+	}
+	return written;
+}
+
+} //namespace histeq
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+
+#include "Equalizer.h"
+#include "CpuEngine.h"
+#include "Batch.h"
+
+namespace histeq {
+
+//Temporal equalization of a sequence of frames, every frame is mapped with the LUT of the summed histograms of the last K frames.
+//The histograms are kept in a ring (on the device when there is one) and the running sum gains the newest frame and loses the oldest,
+//so earlier frames are never rescanned and each frame costs one histogram pass and one map pass. Smoothing over the window also removes flicker.
+//Values are binned over the full 0-255 range, so the histograms of frames with different maxima still line up.
+class SlidingWindowEqualizer {
+public:
+	SlidingWindowEqualizer(DeviceState* state, CpuEngine* cpu, int bin_size, int window)
+		: state(state), cpu(cpu), bin_size(bin_size), window(max(1, window)) {
+		if (state) {
+			//The ring lives in the per channel buffers, one run of bins per slot, the running sum in the histogram buffer
+			buffers.Reserve(state->context, 1, bin_size);
+			buffers.ReserveChannels(state->context, this->window, bin_size);
+			buffers.maximum_value = 255;
+			state->queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, this->window * bin_size * sizeof(unsigned int));
+			state->queue.enqueueFillBuffer(buffers.histogram_buffer, (cl_uint)0, 0, bin_size * sizeof(unsigned int));
+			state->queue.enqueueWriteBuffer(buffers.maximumValue, CL_TRUE, 0, sizeof(int), &buffers.maximum_value);
+		}
+		else {
+			ring.assign((size_t)this->window * bin_size, 0);
+			sum.assign(bin_size, 0);
+		}
+	}
+
+	//Equalizes the next frame of the sequence, done is only set when the frame went through the device
+	CImg<unsigned char> Equalize(const CImg<unsigned char>& frame, cl::Event& done) {
+		int slot = frames++ % window;
+		CImg<unsigned char> output(frame.width(), frame.height(), frame.depth(), frame.spectrum());
+		if (state) { EnqueueFrame(frame, output, slot, done); done.wait(); }
+		else { EqualizeOnHost(frame, output, slot); }
+		return output;
+	}
+
+	int Frames() const { return frames; }
+
+private:
+	void EnqueueFrame(const CImg<unsigned char>& frame, CImg<unsigned char>& output, int slot, cl::Event& done) {
+		cl::CommandQueue& queue = state->queue;
+		int size = (int)frame.size();
+		buffers.Reserve(state->context, size, bin_size);
+		queue.enqueueWriteBuffer(buffers.dev_image_input, CL_FALSE, 0, size, frame.data());
+
+		cl::Kernel& retireKern = state->Kernel("windowRetire");
+		retireKern.setArg(0, buffers.channel_histograms);
+		retireKern.setArg(1, buffers.histogram_buffer);
+		retireKern.setArg(2, slot);
+		queue.enqueueNDRangeKernel(retireKern, cl::NullRange, cl::NDRange(bin_size), cl::NullRange);
+
+		cl::Kernel& histogramKern = state->Kernel("histogramWindow");
+		size_t histogramGroup = WorkGroupSize(*state, histogramKern, 256);
+		histogramKern.setArg(0, buffers.dev_image_input);
+		histogramKern.setArg(1, buffers.channel_histograms);
+		histogramKern.setArg(2, buffers.histogram_buffer);
+		histogramKern.setArg(3, cl::Local(bin_size * sizeof(unsigned int)));
+		histogramKern.setArg(4, size);
+		histogramKern.setArg(5, bin_size);
+		histogramKern.setArg(6, slot);
+		queue.enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(RoundUp(size, histogramGroup)), cl::NDRange(histogramGroup));
+
+		//The running sum is scanned and normalized as a single channel
+		cl::Kernel& scanKern = state->Kernel("scanChannels");
+		size_t scanGroup = WorkGroupSize(*state, scanKern, 256);
+		scanKern.setArg(0, buffers.histogram_buffer);
+		scanKern.setArg(1, buffers.maximumValue);
+		scanKern.setArg(2, buffers.cumulative_buffer);
+		scanKern.setArg(3, buffers.normalized_hist_buffer);
+		scanKern.setArg(4, cl::Local(2 * scanGroup * sizeof(unsigned int)));
+		scanKern.setArg(5, bin_size);
+		queue.enqueueNDRangeKernel(scanKern, cl::NullRange, cl::NDRange(scanGroup), cl::NDRange(scanGroup));
+
+		cl::Kernel& mapKern = state->Kernel("mapChannels");
+		mapKern.setArg(0, buffers.dev_image_input);
+		mapKern.setArg(1, buffers.normalized_hist_buffer);
+		mapKern.setArg(2, buffers.maximumValue);
+		mapKern.setArg(3, buffers.dev_image_output);
+		mapKern.setArg(4, size);
+		mapKern.setArg(5, bin_size);
+		queue.enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(size), cl::NullRange);
+
+		queue.enqueueReadBuffer(buffers.dev_image_output, CL_FALSE, 0, size, output.data(), NULL, &done);
+	}
+
+	//Same arithmetic as windowRetire, histogramWindow, scanChannels and mapChannels
+	void EqualizeOnHost(const CImg<unsigned char>& frame, CImg<unsigned char>& output, int slot) {
+		vector<unsigned int> frequency = cpu->Histogram(frame.data(), frame.size(), 255, bin_size);
+		unsigned int* oldest = &ring[(size_t)slot * bin_size];
+		for (int i = 0; i < bin_size; i++) {
+			sum[i] += frequency[i] - oldest[i];
+			oldest[i] = frequency[i];
+		}
+
+		vector<unsigned char> normalized(bin_size);
+		unsigned int total = 0;
+		for (int i = 0; i < bin_size; i++) { total += sum[i]; }
+		unsigned int cumulative = 0;
+		for (int i = 0; i < bin_size; i++) {
+			cumulative += sum[i];
+			normalized[i] = (unsigned char)(int)((cumulative / (float)total) * 255);
+		}
+
+		unsigned char lut[256];
+		for (int v = 0; v < 256; v++) { lut[v] = normalized[(int)((v / 255.0f) * (bin_size - 1))]; }
+		cpu->Map(frame.data(), output.data(), frame.size(), lut);
+	}
+
+	DeviceState* state;
+	CpuEngine* cpu;
+	int bin_size;
+	int window;
+	int frames = 0;
+	ImageBuffers buffers;
+	vector<unsigned int> ring; //host ring and running sum, when there is no device
+	vector<unsigned int> sum;
+};
+
+//Runs a batch as one sequence of frames in file name order through a sliding window.
+//Frames have to be equalized in order, so only decoding the next frame and encoding the previous one overlap with the current frame.
+//Returns the number of frames written.
+inline int RunSlidingWindowBatch(DeviceState* state, CpuEngine* cpu, const vector<string>& files, const string& output_dir, int bin_size, int window, bool verbose) {
+	SlidingWindowEqualizer equalizer(state, cpu, bin_size, window);
+	int processed = 0;
+
+	auto decode = [&](size_t i) { return std::async(std::launch::async, [&files, i] { return LoadImage8(files[i]); }); };
+	future<CImg<unsigned char>> next;
+	future<void> encoding;
+	if (!files.empty()) { next = decode(0); }
+
+	for (size_t i = 0; i < files.size(); i++) {
+		CImg<unsigned char> frame;
+		try {
+			frame = next.get();
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << files[i] << ": " << err._message << std::endl;
+			if (i + 1 < files.size()) { next = decode(i + 1); }
+			continue;
+		}
+		if (i + 1 < files.size()) { next = decode(i + 1); }
+
+		cl::Event done;
+		auto start = std::chrono::steady_clock::now();
+		CImg<unsigned char> output = equalizer.Equalize(frame, done);
+		double host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		string output_filename = BatchOutputName(output_dir, files[i]);
+		if (encoding.valid()) { encoding.get(); }
+		encoding = std::async(std::launch::async, [output = std::move(output), output_filename, &processed]() {
+			try {
+				output.save(output_filename.c_str());
+				processed++;
+			}
+			catch (CImgException& err) {
+				std::cerr << "ERROR: " << output_filename << ": " << err._message << std::endl;
+			}
+		});
+
+		if (verbose) {
+			std::cout << files[i] << " -> " << output_filename << " (frame " << equalizer.Frames() << ", " << frame.width() << "x" << frame.height() << "x" << frame.spectrum() << "), ";
+			if (state) { std::cout << GetFullProfilingInfo(done, ProfilingResolution::PROF_US) << std::endl; }
+			else { std::cout << "CPU " << host_us << " [us]" << std::endl; }
+		}
+	}
+	if (encoding.valid()) { encoding.get(); }
+	return processed;
+}
+
+} //namespace histeq
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "Equalizer.h"
+#include "Batch.h"
+
+namespace histeq {
+
+//Volumes (image stacks) are images with a depth. A plane is a width x height slice of one channel, CImg keeps slice z of channel c
+//as plane c * depth + z, so any run of planes is contiguous and a volume too large for the device can be streamed through it a slab of planes at a time.
+
+//A run of planes and, in the clahe mode, the tiles whose voxels all lie in it
+struct Slab {
+	int first_plane;
+	int planes;
+	int first_tile;
+	int tiles;
+};
+
+//Loads a volume file (any format CImg reads with a depth, e.g. .cimg, .inr, .hdr/.nii), or a stack of 2D slices given as a directory,
+//a pattern or a text file listing them as in batch mode, stacked along z in that order
+inline CImg<unsigned char> LoadVolume(const string& spec) {
+	fs::path path(spec);
+	bool stack = fs::is_directory(path) || spec.find_first_of("*?") != string::npos || path.extension() == ".txt";
+	if (!stack) { return LoadImage8(spec); }
+
+	vector<string> files = ListBatchInputs(spec);
+	if (files.empty()) { throw CImgIOException("no slices in '%s'", spec.c_str()); }
+	CImg<unsigned char> first = LoadImage8(files[0]);
+	CImg<unsigned char> volume(first.width(), first.height(), (int)files.size(), first.spectrum());
+	for (size_t z = 0; z < files.size(); z++) {
+		CImg<unsigned char> slice = z == 0 ? first : LoadImage8(files[z]);
+		if (!slice.is_sameXYC(first) || slice.depth() != 1) { throw CImgIOException("slice '%s' is %dx%dx%dx%d, the stack started with %dx%dx1x%d", files[z].c_str(), slice.width(), slice.height(), slice.depth(), slice.spectrum(), first.width(), first.height(), first.spectrum()); }
+		volume.draw_image(0, 0, (int)z, 0, slice);
+	}
+	return volume;
+}
+
+//Writes a volume, formats without a depth (PNM, BMP, PNG, JPEG) get one numbered file per slice (e.g. out_000000.pgm)
+inline void SaveVolume(const CImg<unsigned char>& volume, const string& filename) {
+	if (volume.depth() == 1 || !IsImageFile(filename)) {
+		volume.save(filename.c_str());
+		return;
+	}
+	for (int z = 0; z < volume.depth(); z++) { volume.get_slice(z).save(filename.c_str(), z); }
+}
+
+//Default slab size: two slabs are in flight, each with an input and an output buffer, and a slab fits in a single allocation
+inline size_t DefaultSlabBytes(const DeviceState& state) {
+	cl_ulong max_alloc = state.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	cl_ulong global_mem = state.device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	return (size_t)min(min(max_alloc, global_mem / 8), (cl_ulong)1 << 30);
+}
+
+//Splits a volume into slabs of at most slab_bytes (and at least one plane, or one tile layer).
+//In the clahe mode the slabs are runs of whole tile layers, so every tile histogram is built from a single slab.
+inline vector<Slab> VolumeSlabs(const CImg<unsigned char>& volume, const EqualizeOptions& options, size_t slab_bytes) {
+	vector<Slab> slabs;
+	size_t planeSize = (size_t)volume.width() * volume.height();
+	int planes = volume.depth() * volume.spectrum();
+	int budget = (int)max(slab_bytes / planeSize, (size_t)1);
+	if (options.mode != "clahe") {
+		for (int p = 0; p < planes; p += budget) { slabs.push_back({ p, min(budget, planes - p), 0, 0 }); }
+		return slabs;
+	}
+
+	TileGrid grid = ClaheTiles(volume, options);
+	int layerTiles = grid.tilesX * grid.tilesY;
+	for (int c = 0; c < volume.spectrum(); c++) {
+		for (int tz = 0; tz < grid.tilesZ; tz++) {
+			int count = min(grid.tileDepth, grid.depth - tz * grid.tileDepth);
+			if (!slabs.empty() && slabs.back().planes + count <= budget) {
+				slabs.back().planes += count;
+				slabs.back().tiles += layerTiles;
+			}
+			else {
+				slabs.push_back({ c * grid.depth + tz * grid.tileDepth, count, (c * grid.tilesZ + tz) * layerTiles, layerTiles });
+			}
+		}
+	}
+	return slabs;
+}
+
+//Streams a volume through the device a slab at a time, alternating between two in-order queues so one slab uploads while the other computes.
+//The slice mode equalizes each slab in one go as its slices do not depend on one another. The global and clahe modes make two passes,
+//the first builds the histograms, which stay on the device in buffers, and the second maps the slabs in reverse order so the last two
+//slabs of the first pass are mapped without uploading them again.
+//The clahe mode needs box tiles (a tile depth) for volumes.
+inline CImg<unsigned char> EqualizeVolumeSlabs(DeviceState& state, ImageBuffers& buffers, const CImg<unsigned char>& volume, const EqualizeOptions& options, const vector<Slab>& slabs) {
+	const int slot_count = 2;
+	int bin_size = options.bin_size;
+	size_t planeSize = (size_t)volume.width() * volume.height();
+	int maximum = volume.max();
+	int slabPlanes = 0;
+	for (const Slab& slab : slabs) { slabPlanes = max(slabPlanes, slab.planes); }
+
+	CImg<unsigned char> output(volume.width(), volume.height(), volume.depth(), volume.spectrum());
+	vector<cl::CommandQueue> queues(slot_count);
+	vector<ImageBuffers> slots(slot_count);
+	vector<cl::Event> done(slot_count);
+	for (int s = 0; s < slot_count; s++) {
+		queues[s] = cl::CommandQueue(state.context, state.device);
+		slots[s].pool = state.pool.get();
+		slots[s].Reserve(state.context, slabPlanes * planeSize, bin_size);
+	}
+
+	auto upload = [&](int k) {
+		const Slab& slab = slabs[k];
+		queues[k % slot_count].enqueueWriteBuffer(slots[k % slot_count].dev_image_input, CL_FALSE, 0, slab.planes * planeSize, volume.data() + slab.first_plane * planeSize);
+	};
+	auto download = [&](int k) {
+		const Slab& slab = slabs[k];
+		queues[k % slot_count].enqueueReadBuffer(slots[k % slot_count].dev_image_output, CL_FALSE, 0, slab.planes * planeSize, output.data() + slab.first_plane * planeSize, NULL, &done[k % slot_count]);
+	};
+	auto finish = [&] {
+		for (cl::CommandQueue& queue : queues) { queue.finish(); }
+	};
+	auto release = [&] {
+		for (ImageBuffers& slot : slots) { slot.ReleaseToPool(); }
+	};
+
+	if (options.mode == "slice") {
+		for (int k = 0; k < (int)slabs.size(); k++) {
+			//The slot's maxima are rewritten from the host, so its previous slab has to be done first
+			int s = k % slot_count;
+			if (done[s]()) { done[s].wait(); }
+			const Slab& slab = slabs[k];
+			CImg<unsigned char> in(volume.data() + slab.first_plane * planeSize, volume.width(), volume.height(), slab.planes, 1, true);
+			CImg<unsigned char> out(output.data() + slab.first_plane * planeSize, volume.width(), volume.height(), slab.planes, 1, true);
+			EnqueueEqualizeChannels(state, queues[s], slots[s], in, out, bin_size, done[s], slab.planes);
+			queues[s].flush();
+		}
+		finish();
+		release();
+		return output;
+	}
+
+	TileGrid grid = ClaheTiles(volume, options);
+	if (options.mode == "clahe") {
+		buffers.ReserveChannels(state.context, grid.tiles, bin_size);
+	}
+	else {
+		//The whole volume is one histogram, binned with the volume's maximum
+		buffers.ReserveChannels(state.context, 1, bin_size);
+		buffers.channel_maximum_values[0] = maximum;
+		state.queue.enqueueWriteBuffer(buffers.channel_maxima, CL_FALSE, 0, sizeof(int), buffers.channel_maximum_values.data());
+		state.queue.enqueueFillBuffer(buffers.channel_histograms, (cl_uint)0, 0, bin_size * sizeof(unsigned int));
+		state.queue.finish();
+	}
+
+	//Pass 1, the histograms
+	for (int k = 0; k < (int)slabs.size(); k++) {
+		const Slab& slab = slabs[k];
+		int s = k % slot_count;
+		upload(k);
+		if (options.mode == "clahe") {
+			EnqueueClaheHistograms3D(state, queues[s], buffers, slots[s].dev_image_input, grid, options, maximum, slab.first_plane, slab.first_tile, slab.tiles);
+		}
+		else {
+			//Each slab is added to the same histogram as a single plane
+			int voxels = (int)(slab.planes * planeSize);
+			cl::Kernel& histogramKern = state.Kernel("histogramChannels");
+			size_t histogramGroup = WorkGroupSize(state, histogramKern, 256);
+			histogramKern.setArg(0, slots[s].dev_image_input);
+			histogramKern.setArg(1, buffers.channel_maxima);
+			histogramKern.setArg(2, buffers.channel_histograms);
+			histogramKern.setArg(3, cl::Local(bin_size * sizeof(unsigned int)));
+			histogramKern.setArg(4, voxels);
+			histogramKern.setArg(5, bin_size);
+			queues[s].enqueueNDRangeKernel(histogramKern, cl::NullRange, cl::NDRange(RoundUp(voxels, histogramGroup), 1), cl::NDRange(histogramGroup, 1));
+		}
+		queues[s].flush();
+	}
+	finish();
+
+	//Every LUT
+	if (options.mode == "clahe") {
+		EnqueueClaheLuts(state, queues[0], buffers, grid, options, maximum);
+	}
+	else {
+		cl::Kernel& scanKern = state.Kernel("scanChannels");
+		size_t scanGroup = WorkGroupSize(state, scanKern, 256);
+		scanKern.setArg(0, buffers.channel_histograms);
+		scanKern.setArg(1, buffers.channel_maxima);
+		scanKern.setArg(2, buffers.channel_cumulative);
+		scanKern.setArg(3, buffers.channel_luts);
+		scanKern.setArg(4, cl::Local(2 * scanGroup * sizeof(unsigned int)));
+		scanKern.setArg(5, bin_size);
+		queues[0].enqueueNDRangeKernel(scanKern, cl::NullRange, cl::NDRange(scanGroup), cl::NDRange(scanGroup));
+	}
+	queues[0].finish();
+
+	//Pass 2, the map, last slab first
+	for (int k = (int)slabs.size() - 1; k >= 0; k--) {
+		const Slab& slab = slabs[k];
+		int s = k % slot_count;
+		size_t voxels = slab.planes * planeSize;
+		if (k < (int)slabs.size() - slot_count) { upload(k); }
+		if (options.mode == "clahe") {
+			EnqueueClaheMap3D(state, queues[s], buffers, slots[s].dev_image_input, slots[s].dev_image_output, grid, options, maximum, slab.first_plane, voxels);
+		}
+		else {
+			cl::Kernel& mapKern = state.Kernel("mapChannels");
+			mapKern.setArg(0, slots[s].dev_image_input);
+			mapKern.setArg(1, buffers.channel_luts);
+			mapKern.setArg(2, buffers.channel_maxima);
+			mapKern.setArg(3, slots[s].dev_image_output);
+			mapKern.setArg(4, (int)voxels);
+			mapKern.setArg(5, bin_size);
+			queues[s].enqueueNDRangeKernel(mapKern, cl::NullRange, cl::NDRange(voxels), cl::NullRange);
+		}
+		download(k);
+		queues[s].flush();
+	}
+	finish();
+	release();
+	return output;
+}
+
+} //namespace histeq